@@ -0,0 +1,91 @@
+#include "bench.h"
+
+#include <chrono>
+
+#include "picojson.h"
+#include "spdlog/spdlog.h"
+
+// Number of timed samples, reported time is taken from the fastest and the median sample
+static const u32 BENCH_SAMPLES = 5;
+
+BenchSuite::BenchSuite(const fs::path& workDir, const std::string& filter, i64 minTimeMillis)
+    : workDir(workDir), filter(filter), minTimeMillis(minTimeMillis) {
+}
+
+bool BenchSuite::isSelected(const std::string& name) const {
+    return filter.empty() || name.find(filter) != std::string::npos;
+}
+
+bool BenchSuite::isAnySelected(const std::vector<std::string>& names) const {
+    return std::any_of(names.begin(), names.end(), [this](const auto& name) { return isSelected(name); });
+}
+
+static i64 timeIterations(const BenchFunction& function, u64 iterations) {
+    auto start = std::chrono::steady_clock::now();
+    function(iterations);
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+void BenchSuite::run(const std::string& name, u64 bytes, BenchFunction function) {
+    if (!isSelected(name)) return;
+    // double iterations until single sample takes its share of minimal time, first run also warms up caches
+    const i64 sampleNanos = minTimeMillis * 1000000 / BENCH_SAMPLES;
+    u64 iterations = 1;
+    while (timeIterations(function, iterations) < sampleNanos && iterations < (1ull << 40)) {
+        iterations *= 2;
+    }
+    std::vector<double> nanosPerOp;
+    for (u32 i = 0; i < BENCH_SAMPLES; i++) {
+        nanosPerOp.push_back(static_cast<double>(timeIterations(function, iterations)) / iterations);
+    }
+    std::sort(nanosPerOp.begin(), nanosPerOp.end());
+    double median = nanosPerOp[BENCH_SAMPLES / 2];
+
+    picojson::object json;
+    json["name"] = picojson::value(name);
+    json["iterations"] = picojson::value(static_cast<i64>(iterations));
+    json["samples"] = picojson::value(static_cast<i64>(BENCH_SAMPLES));
+    json["bytes"] = picojson::value(static_cast<i64>(bytes));
+    json["ns_per_op_min"] = picojson::value(nanosPerOp.front());
+    json["ns_per_op_median"] = picojson::value(median);
+    if (bytes > 0) {
+        json["mb_per_s"] = picojson::value(bytes / median * 1e9 / (1024 * 1024));
+    }
+    std::cout << picojson::value(json).serialize() << std::endl;
+}
+
+const fs::path& BenchSuite::getWorkDir() const {
+    return workDir;
+}
+
+int main(int argc, const char* argv[]) {
+    // log messages would be mixed with results on stdout
+    spdlog::set_level(spdlog::level::err);
+    std::string filter;
+    i64 minTimeMillis = 500;
+    fs::path workDir = fs::temp_directory_path() / "fine-bench";
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--min-time" && i + 1 < argc) {
+            minTimeMillis = std::stoll(argv[++i]);
+        } else if (arg == "--work-dir" && i + 1 < argc) {
+            workDir = fs::u8path(argv[++i]);
+        } else if (arg.rfind("--", 0) != 0) {
+            filter = arg;
+        } else {
+            std::cerr << "Usage: fine_bench [filter] [--min-time ms] [--work-dir path]" << std::endl;
+            return 1;
+        }
+    }
+    try {
+        fs::remove_all(workDir);
+        fs::create_directories(workDir);
+        BenchSuite suite(workDir, filter, minTimeMillis);
+        runCoreBenchmarks(suite);
+        fs::remove_all(workDir);
+    } catch (const std::runtime_error& e) {
+        std::cerr << "Benchmark failed " << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include "platform.h"
+
+// Runs benchmarked operation given number of times
+using BenchFunction = std::function<void(u64 iterations)>;
+
+// Runs benchmarks and prints one JSON object per benchmark to stdout
+class BenchSuite {
+  public:
+    BenchSuite(const fs::path& workDir, const std::string& filter, i64 minTimeMillis);
+    bool isSelected(const std::string& name) const;
+    // Used to skip setup shared by benchmarks that are all excluded by filter
+    bool isAnySelected(const std::vector<std::string>& names) const;
+    // Bytes processed by single iteration are used to report throughput, 0 when throughput doesn't apply
+    void run(const std::string& name, u64 bytes, BenchFunction function);
+    const fs::path& getWorkDir() const;
+
+  private:
+    const fs::path workDir;
+    const std::string filter;
+    const i64 minTimeMillis;
+};
+
+void runCoreBenchmarks(BenchSuite& suite);
+
+// Prevents compiler from removing computation of the value
+template <typename T>
+inline void benchKeep(const T& value) {
+    asm volatile("" : : "r"(&value) : "memory");
+}
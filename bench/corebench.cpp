@@ -0,0 +1,406 @@
+#include "bench.h"
+
+#include <random>
+
+#include "spdlog/spdlog.h"
+
+#include "bitstream.h"
+#include "cpk.h"
+#include "fine.h"
+#include "iso9660.h"
+#include "isoutils.h"
+#include "patchfs.h"
+#include "stream.h"
+
+static const usize STREAM_BENCH_SIZE = 1024 * 1024;
+static const usize STREAM_BENCH_BLOCK = 64 * 1024;
+static const u32 PATCHFS_BENCH_ENTRIES = 4096;
+// Names of benchmarks run by benchStreamPrimitives
+static const std::vector<std::string> STREAM_BENCH_NAMES = {"readByte", "readInt",      "readIntB",     "writeByte",
+                                                            "writeInt", "readFully64K", "writeFully64K"};
+
+// Names of all combinations of prefixes and suffixes
+static std::vector<std::string> benchNames(const std::vector<std::string>& prefixes,
+                                           const std::vector<std::string>& suffixes) {
+    std::vector<std::string> names;
+    for (const auto& prefix : prefixes) {
+        for (const auto& suffix : suffixes) {
+            names.push_back(prefix + suffix);
+        }
+    }
+    return names;
+}
+
+static ByteBuffer randomBuffer(usize size, u32 seed) {
+    std::mt19937 rng(seed);
+    ByteBuffer buf(size);
+    for (auto& byte : buf) {
+        byte = rng();
+    }
+    return buf;
+}
+
+// Wraps stream position to the start before it would run past the end of benchmark buffer
+static void benchStreamPrimitives(BenchSuite& suite, const std::string& prefix, Stream& stream) {
+    suite.run(prefix + "/readByte", 1, [&](u64 iterations) {
+        for (u64 i = 0; i < iterations; i++) {
+            if (i % STREAM_BENCH_SIZE == 0) stream.seek(0);
+            benchKeep(stream.readByte());
+        }
+    });
+    suite.run(prefix + "/readInt", 4, [&](u64 iterations) {
+        for (u64 i = 0; i < iterations; i++) {
+            if (i % (STREAM_BENCH_SIZE / 4) == 0) stream.seek(0);
+            benchKeep(stream.readInt());
+        }
+    });
+    suite.run(prefix + "/readIntB", 4, [&](u64 iterations) {
+        for (u64 i = 0; i < iterations; i++) {
+            if (i % (STREAM_BENCH_SIZE / 4) == 0) stream.seek(0);
+            benchKeep(stream.readIntB());
+        }
+    });
+    suite.run(prefix + "/writeByte", 1, [&](u64 iterations) {
+        for (u64 i = 0; i < iterations; i++) {
+            if (i % STREAM_BENCH_SIZE == 0) stream.seek(0);
+            stream.writeByte(i);
+        }
+    });
+    suite.run(prefix + "/writeInt", 4, [&](u64 iterations) {
+        for (u64 i = 0; i < iterations; i++) {
+            if (i % (STREAM_BENCH_SIZE / 4) == 0) stream.seek(0);
+            stream.writeInt(i);
+        }
+    });
+    ByteBuffer block = randomBuffer(STREAM_BENCH_BLOCK, 1);
+    suite.run(prefix + "/readFully64K", STREAM_BENCH_BLOCK, [&](u64 iterations) {
+        for (u64 i = 0; i < iterations; i++) {
+            if (i % (STREAM_BENCH_SIZE / STREAM_BENCH_BLOCK) == 0) stream.seek(0);
+            stream.readFully(block);
+        }
+    });
+    suite.run(prefix + "/writeFully64K", STREAM_BENCH_BLOCK, [&](u64 iterations) {
+        for (u64 i = 0; i < iterations; i++) {
+            if (i % (STREAM_BENCH_SIZE / STREAM_BENCH_BLOCK) == 0) stream.seek(0);
+            stream.writeFully(block);
+        }
+    });
+}
+
+static void benchStreams(BenchSuite& suite) {
+    bool memory = suite.isAnySelected(benchNames({"stream/memory/"}, STREAM_BENCH_NAMES));
+    bool file = suite.isAnySelected(benchNames({"stream/file/"}, STREAM_BENCH_NAMES));
+    if (!memory && !file) return;
+    ByteBuffer buf = randomBuffer(STREAM_BENCH_SIZE, 2);
+    if (memory) {
+        Stream stream(buf);
+        benchStreamPrimitives(suite, "stream/memory", stream);
+    }
+    if (file) {
+        fs::path path = suite.getWorkDir() / "stream.bin";
+        writeFile(path, buf);
+        Stream stream(path);
+        benchStreamPrimitives(suite, "stream/file", stream);
+    }
+}
+
+static void benchBitStream(BenchSuite& suite) {
+    if (!suite.isAnySelected(benchNames({"bitstream/readInt"}, {"1", "13", "32"}))) return;
+    const ByteBuffer buf = randomBuffer(STREAM_BENCH_SIZE, 3);
+    for (u32 bits : {1, 13, 32}) {
+        // bit stream can't be rewound, it's recreated once all bits were read
+        const u64 readsPerStream = buf.size() * 8 / bits;
+        suite.run("bitstream/readInt" + std::to_string(bits), 0, [&](u64 iterations) {
+            auto bitStream = std::make_unique<BitStream>(buf);
+            for (u64 i = 0; i < iterations; i++) {
+                if (i % readsPerStream == readsPerStream - 1) {
+                    bitStream = std::make_unique<BitStream>(buf);
+                }
+                benchKeep(bitStream->readInt(bits));
+            }
+        });
+    }
+}
+
+class LaylaBitWriter {
+  public:
+    void write(u32 value, u32 bits) {
+        for (u32 i = 0; i < bits; i++) {
+            current = (current << 1) | ((value >> (bits - 1 - i)) & 1);
+            if (++count == 8) {
+                bytes.push_back(current);
+                current = 0;
+                count = 0;
+            }
+        }
+    }
+    ByteBuffer finish() {
+        if (count > 0) {
+            write(0, 8 - count);
+        }
+        return std::move(bytes);
+    }
+
+  private:
+    ByteBuffer bytes;
+    u8 current = 0;
+    u8 count = 0;
+};
+
+// Builds valid CRILAYLA data mixing literals and back references of random lengths
+static ByteBuffer createLaylaData(u32 size) {
+    std::mt19937 rng(4);
+    LaylaBitWriter writer;
+    u32 pos = 0;
+    while (pos < size) {
+        u32 remaining = size - pos;
+        if (pos >= 3 && remaining >= 3 && rng() % 4 != 0) {
+            u32 lookBehind = 3 + rng() % std::min<u32>(pos - 2, 8192);
+            u32 repetitions = 3 + rng() % (std::min<u32>(remaining, 40) - 2);
+            writer.write(1, 1);
+            writer.write(lookBehind - 3, 13);
+            u32 marker = repetitions - 3;
+            for (u32 bits : {2, 3, 5, 8, 8, 8, 8, 8, 8}) {
+                u32 limit = (1 << bits) - 1;
+                writer.write(std::min(marker, limit), bits);
+                if (marker < limit) break;
+                marker -= limit;
+            }
+            pos += repetitions;
+        } else {
+            writer.write(0, 1);
+            writer.write(rng() % 64, 8);
+            pos++;
+        }
+    }
+    ByteBuffer compressed = writer.finish();
+    std::reverse(compressed.begin(), compressed.end());
+    ByteBuffer data(16 + compressed.size() + 0x100);
+    Stream stream(data);
+    stream.writeString("CRILAYLA");
+    stream.writeInt(size);
+    stream.writeInt(compressed.size());
+    stream.writeFully(compressed);
+    return data;
+}
+
+static void benchLayla(BenchSuite& suite) {
+    if (!suite.isSelected("cpk/decompressLayla/1M")) return;
+    const u32 size = 1024 * 1024;
+    ByteBuffer data = createLaylaData(size);
+    suite.run("cpk/decompressLayla/1M", size, [&](u64 iterations) {
+        for (u64 i = 0; i < iterations; i++) {
+            benchKeep(decompressLayla(data));
+        }
+    });
+}
+
+static void benchApplyPatch(BenchSuite& suite) {
+    for (auto [label, size] :
+         {std::pair("64K", 64 * 1024), std::pair("1M", 1024 * 1024), std::pair("16M", 16 * 1024 * 1024)}) {
+        std::string name = std::string("applyPatch/") + label;
+        if (!suite.isSelected(name)) continue;
+        ByteBuffer source = randomBuffer(size, 5);
+        ByteBuffer target = source;
+        // small edit in every 4 KB block, similar to patched game data
+        std::mt19937 rng(6);
+        for (usize offset = 0; offset + 64 < target.size(); offset += 4096) {
+            usize editOffset = offset + rng() % (4096 - 64);
+            for (usize i = 0; i < 16 && editOffset + i < target.size(); i++) {
+                target[editOffset + i] = rng();
+            }
+        }
+        ByteBuffer patch = createPatch(source.data(), source.size(), target.data(), target.size());
+        ByteBuffer output(target.size());
+        suite.run(name, size, [&](u64 iterations) {
+            for (u64 i = 0; i < iterations; i++) {
+                applyPatch(source.data(), source.size(), patch.data(), patch.size(), output.data(), output.size());
+            }
+        });
+    }
+}
+
+static void writeIsoDirectoryRecord(Stream& iso, const std::string& name, u32 lba, u32 length, u8 atributes) {
+    iso.writeByte(33 + name.size() + (name.size() % 2 == 0 ? 1 : 0));
+    iso.writeByte(0);
+    iso.writeInt(lba);
+    iso.writeIntB(lba);
+    iso.writeInt(length);
+    iso.writeIntB(length);
+    iso.writeZeros(7);
+    iso.writeByte(atributes);
+    iso.writeByte(0);
+    iso.writeByte(0);
+    iso.writeShort(1);
+    iso.writeShortB(1);
+    iso.writeByte(name.size());
+    iso.writeString(name);
+    if (name.size() % 2 == 0) {
+        iso.writeByte(0);
+    }
+}
+
+static u32 isoSectorsFor(usize bytes) {
+    return (bytes + ISO_SECTOR_SIZE - 1) / ISO_SECTOR_SIZE;
+}
+
+static std::string isoDirName(u32 dir) {
+    return fmt::format("DIR{:04}", dir);
+}
+
+static std::string isoFileName(u32 file) {
+    return fmt::format("FILE{:04}.BIN;1", file);
+}
+
+// Creates image with root directory containing subdirectories of files, all files share single data sector
+static void createSyntheticIso(const fs::path& path, u32 dirs, u32 filesPerDir) {
+    const std::string rootName(1, '\0');
+    const usize dirNameLength = isoDirName(0).size();
+    const usize fileNameLength = isoFileName(0).size();
+    const usize pathTableSize = 10 + dirs * (8 + dirNameLength + dirNameLength % 2);
+    // directory extents are terminated by zero length record
+    const u32 rootSectors = isoSectorsFor(dirs * (34 + dirNameLength - dirNameLength % 2) + 1);
+    const u32 dirSectors = isoSectorsFor(filesPerDir * (34 + fileNameLength - fileNameLength % 2) + 1);
+    const u32 pathTableLba = 18;
+    const u32 rootLba = pathTableLba + isoSectorsFor(pathTableSize);
+    const u32 firstDirLba = rootLba + rootSectors;
+    const u32 dataLba = firstDirLba + dirs * dirSectors;
+    const u32 totalSectors = dataLba + 1;
+
+    ByteBuffer image(static_cast<usize>(totalSectors) * ISO_SECTOR_SIZE);
+    Stream iso(image);
+    iso.seek(16 * ISO_SECTOR_SIZE);
+    iso.writeByte(1);
+    iso.writeString("CD001");
+    iso.writeByte(1);
+    iso.writeZeros(1 + 32 + 32 + 8);
+    iso.writeInt(totalSectors);
+    iso.writeIntB(totalSectors);
+    iso.writeZeros(32);
+    for (u16 value : {1u, 1u, ISO_SECTOR_SIZE}) {
+        iso.writeShort(value);
+        iso.writeShortB(value);
+    }
+    iso.writeInt(pathTableSize);
+    iso.writeIntB(pathTableSize);
+    iso.writeInt(pathTableLba);
+    iso.writeInt(0);
+    iso.writeIntB(pathTableLba);
+    iso.writeIntB(0);
+    writeIsoDirectoryRecord(iso, rootName, rootLba, rootSectors * ISO_SECTOR_SIZE, 2);
+
+    iso.seek(17 * ISO_SECTOR_SIZE);
+    iso.writeByte(255);
+    iso.writeString("CD001");
+    iso.writeByte(1);
+
+    iso.seek(pathTableLba * ISO_SECTOR_SIZE);
+    for (u32 dir = 0; dir <= dirs; dir++) {
+        std::string name = dir == 0 ? rootName : isoDirName(dir - 1);
+        iso.writeByte(name.size());
+        iso.writeByte(0);
+        iso.writeInt(dir == 0 ? rootLba : firstDirLba + (dir - 1) * dirSectors);
+        iso.writeShort(1);
+        iso.writeString(name);
+        if (name.size() % 2 == 1) {
+            iso.writeByte(0);
+        }
+    }
+
+    iso.seek(rootLba * ISO_SECTOR_SIZE);
+    for (u32 dir = 0; dir < dirs; dir++) {
+        writeIsoDirectoryRecord(iso, isoDirName(dir), firstDirLba + dir * dirSectors, dirSectors * ISO_SECTOR_SIZE, 2);
+    }
+    for (u32 dir = 0; dir < dirs; dir++) {
+        iso.seek((firstDirLba + dir * dirSectors) * ISO_SECTOR_SIZE);
+        for (u32 file = 0; file < filesPerDir; file++) {
+            writeIsoDirectoryRecord(iso, isoFileName(file), dataLba, ISO_SECTOR_SIZE, 0);
+        }
+    }
+    writeFile(path, image);
+}
+
+static void benchIso(BenchSuite& suite) {
+    for (auto [dirs, filesPerDir] : {std::pair(16u, 64u), std::pair(64u, 256u)}) {
+        std::string label = std::to_string(dirs) + "x" + std::to_string(filesPerDir);
+        bool read = suite.isSelected("iso/Iso9660Reader/" + label);
+        bool seek = suite.isSelected("iso/seekToIsoFile/" + label);
+        if (!read && !seek) continue;
+        fs::path path = suite.getWorkDir() / ("synthetic-" + label + ".iso");
+        createSyntheticIso(path, dirs, filesPerDir);
+        suite.run("iso/Iso9660Reader/" + label, 0, [&](u64 iterations) {
+            for (u64 i = 0; i < iterations; i++) {
+                Iso9660Reader reader(path);
+                benchKeep(reader.getRecords().size());
+            }
+        });
+        if (!seek) continue;
+
+        auto records = getIsoRecords(path);
+        std::vector<std::string> files;
+        for (const auto& record : records) {
+            for (const auto& entry : record.getEntries()) {
+                if (entry.atributes == 0) {
+                    files.push_back(entry.relPath);
+                }
+            }
+        }
+        // lookups cycle through all files in scattered order so average cost is measured
+        std::shuffle(files.begin(), files.end(), std::mt19937(7));
+        Stream iso(path, true);
+        suite.run("iso/seekToIsoFile/" + label, 0, [&](u64 iterations) {
+            for (u64 i = 0; i < iterations; i++) {
+                benchKeep(seekToIsoFile(iso, records, files[i % files.size()]).lba);
+            }
+        });
+    }
+}
+
+static void benchPatchFs(BenchSuite& suite) {
+    if (!suite.isAnySelected(benchNames({"patchfs/open/", "patchfs/getFileLength/", "patchfs/getFileView/"},
+                                        {"file", "mapped"}))) {
+        return;
+    }
+    fs::path path = suite.getWorkDir() / "bench.patchfs";
+    std::vector<std::string> names;
+    {
+        PatchFsWriter writer(path, PATCHFS_BENCH_ENTRIES);
+        std::mt19937 rng(8);
+        for (u32 i = 0; i < PATCHFS_BENCH_ENTRIES; i++) {
+            names.push_back(fmt::format("data/dir{:02}/file{:04}.bin", i % 32, i));
+            writer.add(names.back(), randomBuffer(256 + rng() % 4096, i));
+        }
+        writer.finish();
+    }
+    std::shuffle(names.begin(), names.end(), std::mt19937(9));
+    for (bool mapped : {false, true}) {
+        std::string mode = mapped ? "mapped" : "file";
+        suite.run("patchfs/open/" + mode, 0, [&](u64 iterations) {
+            for (u64 i = 0; i < iterations; i++) {
+                PatchFsFile patchFs(path, mapped);
+                benchKeep(patchFs.getFilesCount());
+            }
+        });
+        if (!suite.isAnySelected(benchNames({"patchfs/getFileLength/", "patchfs/getFileView/"}, {mode}))) continue;
+        PatchFsFile patchFs(path, mapped);
+        suite.run("patchfs/getFileLength/" + mode, 0, [&](u64 iterations) {
+            for (u64 i = 0; i < iterations; i++) {
+                benchKeep(patchFs.getFileLength(names[i % names.size()]));
+            }
+        });
+        suite.run("patchfs/getFileView/" + mode, 0, [&](u64 iterations) {
+            for (u64 i = 0; i < iterations; i++) {
+                benchKeep(patchFs.getFileView(names[i % names.size()]).size());
+            }
+        });
+    }
+}
+
+void runCoreBenchmarks(BenchSuite& suite) {
+    benchStreams(suite);
+    benchBitStream(suite);
+    benchLayla(suite);
+    benchApplyPatch(suite);
+    benchIso(suite);
+    benchPatchFs(suite);
+}
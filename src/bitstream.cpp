@@ -2,9 +2,9 @@
 
 #include "spdlog/spdlog.h"
 
-BitStream::BitStream(const ByteBuffer& buf, bool msbOrder)
-    : buf(buf), msbOrder(msbOrder), eof(false), currentByte(buf[0]), pos(0), bitPos(0) {
-    spdlog::trace("Create bit stream for buffer, size: {}, msb order: {}", buf.size(), msbOrder);
+BitStream::BitStream(ByteBuffer buf, bool msbOrder)
+    : buf(std::move(buf)), msbOrder(msbOrder), eof(false), currentByte(this->buf[0]), pos(0), bitPos(0) {
+    spdlog::trace("Create bit stream for buffer, size: {}, msb order: {}", this->buf.size(), msbOrder);
 }
 
 bool BitStream::readBit() {
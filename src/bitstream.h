@@ -4,7 +4,7 @@
 
 class BitStream {
   public:
-    BitStream(const ByteBuffer& buf, bool msbOrder = true);
+    BitStream(ByteBuffer buf, bool msbOrder = true);
     bool readBit();
     u8 readByte();
     u32 readInt(u32 bits = 32);
@@ -0,0 +1,129 @@
+#include "bufferpool.h"
+
+// Smallest and largest size class, as powers of two
+static const u32 POOL_MIN_CLASS = 12;
+static const u32 POOL_MAX_CLASS = 26;
+// Limits memory held by released buffers
+static const usize POOL_MAX_BUFFERS_PER_CLASS = 8;
+static const usize POOL_MAX_BYTES = 256 * 1024 * 1024;
+
+static u32 getSizeClass(usize size) {
+    u32 sizeClass = POOL_MIN_CLASS;
+    while (sizeClass <= POOL_MAX_CLASS && (static_cast<usize>(1) << sizeClass) < size) {
+        sizeClass++;
+    }
+    return sizeClass;
+}
+
+BufferPool& BufferPool::instance() {
+    static BufferPool pool;
+    return pool;
+}
+
+BufferPool::BufferPool() : classes(POOL_MAX_CLASS - POOL_MIN_CLASS + 1), pooledBytes(0) {
+}
+
+std::unique_ptr<u8[]> BufferPool::acquire(usize size, usize& capacity) {
+    u32 sizeClass = getSizeClass(size);
+    if (sizeClass > POOL_MAX_CLASS) {
+        capacity = size;
+        return std::unique_ptr<u8[]>(new u8[size]);
+    }
+    capacity = static_cast<usize>(1) << sizeClass;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto& buffers = classes[sizeClass - POOL_MIN_CLASS];
+        if (!buffers.empty()) {
+            std::unique_ptr<u8[]> buffer = std::move(buffers.back());
+            buffers.pop_back();
+            pooledBytes -= capacity;
+            return buffer;
+        }
+    }
+    // default initialization leaves bytes uninitialized
+    return std::unique_ptr<u8[]>(new u8[capacity]);
+}
+
+void BufferPool::release(std::unique_ptr<u8[]> buffer, usize capacity) {
+    u32 sizeClass = getSizeClass(capacity);
+    if (sizeClass > POOL_MAX_CLASS || (static_cast<usize>(1) << sizeClass) != capacity) return;
+    std::lock_guard<std::mutex> lock(mutex);
+    auto& buffers = classes[sizeClass - POOL_MIN_CLASS];
+    if (buffers.size() >= POOL_MAX_BUFFERS_PER_CLASS || pooledBytes + capacity > POOL_MAX_BYTES) return;
+    buffers.push_back(std::move(buffer));
+    pooledBytes += capacity;
+}
+
+PooledBuffer::PooledBuffer() : capacity(0), length(0) {
+}
+
+PooledBuffer::PooledBuffer(usize size) : capacity(0), length(size) {
+    if (size > 0) {
+        storage = BufferPool::instance().acquire(size, capacity);
+    }
+}
+
+PooledBuffer::~PooledBuffer() {
+    release();
+}
+
+PooledBuffer::PooledBuffer(PooledBuffer&& other) noexcept
+    : storage(std::move(other.storage)), capacity(other.capacity), length(other.length) {
+    other.capacity = 0;
+    other.length = 0;
+}
+
+PooledBuffer& PooledBuffer::operator=(PooledBuffer&& other) noexcept {
+    if (this != &other) {
+        release();
+        storage = std::move(other.storage);
+        capacity = other.capacity;
+        length = other.length;
+        other.capacity = 0;
+        other.length = 0;
+    }
+    return *this;
+}
+
+void PooledBuffer::release() {
+    if (storage) {
+        BufferPool::instance().release(std::move(storage), capacity);
+    }
+    capacity = 0;
+    length = 0;
+}
+
+u8* PooledBuffer::data() {
+    return storage.get();
+}
+
+const u8* PooledBuffer::data() const {
+    return storage.get();
+}
+
+usize PooledBuffer::size() const {
+    return length;
+}
+
+bool PooledBuffer::empty() const {
+    return length == 0;
+}
+
+void PooledBuffer::resize(usize newSize) {
+    if (newSize > capacity) {
+        PooledBuffer resized(newSize);
+        if (length > 0) {
+            std::memcpy(resized.data(), data(), length);
+        }
+        *this = std::move(resized);
+    }
+    length = newSize;
+}
+
+u8& PooledBuffer::operator[](usize index) {
+    return storage[index];
+}
+
+const u8& PooledBuffer::operator[](usize index) const {
+    return storage[index];
+}
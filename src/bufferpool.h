@@ -0,0 +1,46 @@
+#pragma once
+
+#include "platform.h"
+
+#include <mutex>
+
+// Uninitialized byte storage taken from BufferPool, storage is returned to the pool when the buffer is destroyed
+class PooledBuffer {
+  public:
+    PooledBuffer();
+    explicit PooledBuffer(usize size);
+    ~PooledBuffer();
+    PooledBuffer(PooledBuffer&& other) noexcept;
+    PooledBuffer& operator=(PooledBuffer&& other) noexcept;
+    PooledBuffer(const PooledBuffer&) = delete;
+    PooledBuffer& operator=(const PooledBuffer&) = delete;
+    u8* data();
+    const u8* data() const;
+    usize size() const;
+    bool empty() const;
+    // Contents up to the new size are kept, new bytes are uninitialized
+    void resize(usize newSize);
+    u8& operator[](usize index);
+    const u8& operator[](usize index) const;
+
+  private:
+    void release();
+    std::unique_ptr<u8[]> storage;
+    usize capacity;
+    usize length;
+};
+
+// Keeps released buffers in power of two size classes so transient buffers of hot loops are reused instead of
+// allocated, zeroed and faulted in again. Buffers outside of size classes are allocated directly.
+class BufferPool {
+  public:
+    static BufferPool& instance();
+    std::unique_ptr<u8[]> acquire(usize size, usize& capacity);
+    void release(std::unique_ptr<u8[]> buffer, usize capacity);
+
+  private:
+    BufferPool();
+    std::mutex mutex;
+    std::vector<std::vector<std::unique_ptr<u8[]>>> classes;
+    usize pooledBytes;
+};
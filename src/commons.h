@@ -7,12 +7,23 @@
 #include "xxhash.h"
 
 #include "bitstream.h"
+#include "bufferpool.h"
 #include "cpk.h"
 #include "exttool.h"
+#include "fileio.h"
+#include "fingerprint.h"
 #include "fine.h"
+#include "iostats.h"
 #include "iso9660.h"
 #include "isoutils.h"
+#include "journal.h"
+#include "manifest.h"
+#include "patchcache.h"
 #include "patchfs.h"
 #include "platform.h"
 #include "progress.h"
+#include "sparse.h"
 #include "stream.h"
+#include "taskpool.h"
+#include "timeline.h"
+#include "vcdiff.h"
@@ -4,6 +4,7 @@
 
 #include "bitstream.h"
 #include "stream.h"
+#include "timeline.h"
 
 class SizeSeq {
   public:
@@ -32,6 +33,7 @@ class SizeSeq {
 };
 
 ByteBuffer decompressLayla(ByteBuffer& bytes) {
+    TIMELINE_SCOPE("decompressLayla");
     spdlog::trace("Decompress LAYLA file, size: {}", bytes.size());
     Stream input(bytes);
     std::string magic = input.readString(8);
@@ -42,14 +44,15 @@ ByteBuffer decompressLayla(ByteBuffer& bytes) {
     u32 sizeOrig = input.readInt();
     u32 sizeComp = input.readInt();
     ByteBuffer compressed(sizeComp);
-    ByteBuffer prefix(0x100);
     input.readFully(compressed);
-    input.readFully(prefix);
+    // uncompressed prefix is stored after compressed data, output starts with it so it's read directly in place
+    ByteBuffer combined(sizeOrig + 0x100);
+    input.readFully(combined.data(), 0x100);
     std::reverse(compressed.begin(), compressed.end());
-    BitStream compressedBits(compressed);
+    BitStream compressedBits(std::move(compressed));
 
-    ByteBuffer decompressed(sizeOrig);
-    Stream decompressedStream(decompressed);
+    u8* decompressed = combined.data() + 0x100;
+    Stream decompressedStream(decompressed, sizeOrig);
 
     while (decompressedStream.pos() < sizeOrig) {
         SizeSeq sizes;
@@ -73,11 +76,6 @@ ByteBuffer decompressLayla(ByteBuffer& bytes) {
             decompressedStream.writeByte(byte);
         }
     }
-    std::reverse(decompressed.begin(), decompressed.end());
-
-    ByteBuffer combined(sizeOrig + 0x100);
-    Stream combinedStream(combined);
-    combinedStream.writeFully(prefix);
-    combinedStream.writeFully(decompressed);
+    std::reverse(decompressed, decompressed + sizeOrig);
     return combined;
 }
@@ -0,0 +1,312 @@
+#include "fileio.h"
+
+#include <atomic>
+
+#ifndef _WIN32
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+// Size of single write call
+static const usize WRITE_CHUNK_SIZE = 8 * 1024 * 1024;
+// Alignment of buffers and lengths required by direct writes
+static const usize DIRECT_ALIGNMENT = 4096;
+
+static fs::path getTemporaryPath(const fs::path& path) {
+    static std::atomic<u32> counter(0);
+    return path.parent_path() / (path.filename().u8string() + ".tmp" + std::to_string(counter++));
+}
+
+// Symlinks are followed so the link is kept and file it points to is replaced, dangling links are replaced by file
+static fs::path resolveWriteTarget(const fs::path& path) {
+    std::error_code ec;
+    if (!fs::is_symlink(path, ec)) return path;
+    fs::path resolved = fs::canonical(path, ec);
+    return ec ? path : resolved;
+}
+
+#ifdef _WIN32
+ReadOnlyFile::ReadOnlyFile(const fs::path& path) : fileLength(0) {
+    handle = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING,
+                         FILE_ATTRIBUTE_NORMAL, NULL);
+    LARGE_INTEGER size;
+    if (handle != INVALID_HANDLE_VALUE && GetFileSizeEx(handle, &size)) {
+        fileLength = size.QuadPart;
+    }
+}
+
+ReadOnlyFile::~ReadOnlyFile() {
+    if (handle != INVALID_HANDLE_VALUE) {
+        CloseHandle(handle);
+    }
+}
+
+bool ReadOnlyFile::good() const {
+    return handle != INVALID_HANDLE_VALUE;
+}
+
+void ReadOnlyFile::readAt(i64 offset, u8* buf, i64 len) const {
+    while (len > 0) {
+        OVERLAPPED overlapped;
+        ZeroMemory(&overlapped, sizeof(overlapped));
+        overlapped.Offset = offset & 0xFFFFFFFF;
+        overlapped.OffsetHigh = offset >> 32;
+        DWORD chunk = std::min<i64>(len, 1 << 30);
+        DWORD readSize;
+        if (!ReadFile(handle, buf, chunk, &readSize, &overlapped) || readSize == 0) {
+            bail("Failed to read file");
+        }
+        offset += readSize;
+        buf += readSize;
+        len -= readSize;
+    }
+}
+
+MappedFile::MappedFile(const fs::path& path) : mapping(NULL), mapped(nullptr), fileLength(0), opened(false) {
+    handle = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL,
+                         NULL);
+    LARGE_INTEGER size;
+    if (handle == INVALID_HANDLE_VALUE || !GetFileSizeEx(handle, &size)) return;
+    fileLength = size.QuadPart;
+    // empty files can't be mapped
+    if (fileLength == 0) {
+        opened = true;
+        return;
+    }
+    mapping = CreateFileMappingW(handle, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (mapping == NULL) return;
+    mapped = static_cast<const u8*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+    opened = mapped != nullptr;
+}
+
+MappedFile::~MappedFile() {
+    if (mapped != nullptr) {
+        UnmapViewOfFile(mapped);
+    }
+    if (mapping != NULL) {
+        CloseHandle(mapping);
+    }
+    if (handle != INVALID_HANDLE_VALUE) {
+        CloseHandle(handle);
+    }
+}
+
+void writeFileAtomic(const fs::path& requestedPath, const u8* data, usize length, __attribute__((unused)) bool direct) {
+    const fs::path path = resolveWriteTarget(requestedPath);
+    fs::path tempPath;
+    HANDLE handle = INVALID_HANDLE_VALUE;
+    for (u32 attempt = 0; attempt < 100 && handle == INVALID_HANDLE_VALUE; attempt++) {
+        tempPath = getTemporaryPath(path);
+        handle = CreateFileW(tempPath.c_str(), GENERIC_WRITE, 0, NULL, CREATE_NEW, FILE_ATTRIBUTE_NORMAL, NULL);
+    }
+    if (handle == INVALID_HANDLE_VALUE) {
+        bail("Failed to open file for writing");
+    }
+    // reserve final size up front so the file is not extended by every write
+    LARGE_INTEGER size;
+    size.QuadPart = length;
+    bool success = SetFilePointerEx(handle, size, NULL, FILE_BEGIN) && SetEndOfFile(handle);
+    size.QuadPart = 0;
+    success = success && SetFilePointerEx(handle, size, NULL, FILE_BEGIN);
+    for (usize pos = 0; success && pos < length;) {
+        DWORD written;
+        DWORD chunk = std::min(length - pos, WRITE_CHUNK_SIZE);
+        success = WriteFile(handle, data + pos, chunk, &written, NULL) && written > 0;
+        pos += written;
+    }
+    success = success && FlushFileBuffers(handle);
+    CloseHandle(handle);
+    if (!success || !MoveFileExW(tempPath.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH)) {
+        DeleteFileW(tempPath.c_str());
+        bail("Failed to write file");
+    }
+}
+#else
+ReadOnlyFile::ReadOnlyFile(const fs::path& path) : fileLength(0) {
+    fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd >= 0 && fstat(fd, &st) == 0) {
+        fileLength = st.st_size;
+    }
+}
+
+ReadOnlyFile::~ReadOnlyFile() {
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+bool ReadOnlyFile::good() const {
+    return fd >= 0;
+}
+
+void ReadOnlyFile::readAt(i64 offset, u8* buf, i64 len) const {
+    while (len > 0) {
+        ssize_t readSize = pread(fd, buf, len, offset);
+        if (readSize < 0 && errno == EINTR) continue;
+        if (readSize <= 0) {
+            bail("Failed to read file");
+        }
+        offset += readSize;
+        buf += readSize;
+        len -= readSize;
+    }
+}
+
+MappedFile::MappedFile(const fs::path& path) : mapped(nullptr), fileLength(0), opened(false) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return;
+    struct stat st;
+    if (fstat(fd, &st) == 0) {
+        fileLength = st.st_size;
+        // empty files can't be mapped
+        if (fileLength == 0) {
+            opened = true;
+        } else {
+            void* addr = mmap(nullptr, fileLength, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (addr != MAP_FAILED) {
+                mapped = static_cast<const u8*>(addr);
+                opened = true;
+            }
+        }
+    }
+    // mapping stays valid after descriptor is closed
+    close(fd);
+}
+
+MappedFile::~MappedFile() {
+    if (mapped != nullptr) {
+        munmap(const_cast<u8*>(mapped), fileLength);
+    }
+}
+
+static bool writeChunks(int fd, const u8* data, usize length) {
+    usize pos = 0;
+    while (pos < length) {
+        ssize_t written = write(fd, data + pos, std::min(length - pos, WRITE_CHUNK_SIZE));
+        if (written < 0 && errno == EINTR) continue;
+        if (written <= 0) return false;
+        pos += written;
+    }
+    return true;
+}
+
+// Direct writes need aligned memory and lengths, data is copied through aligned buffer and the last block is padded
+static bool writeChunksDirect(int fd, const u8* data, usize length) {
+    if (length == 0) return true;
+    usize bufferSize = std::min(WRITE_CHUNK_SIZE, (length + DIRECT_ALIGNMENT - 1) / DIRECT_ALIGNMENT * DIRECT_ALIGNMENT);
+    std::unique_ptr<u8, decltype(&std::free)> buffer(static_cast<u8*>(std::aligned_alloc(DIRECT_ALIGNMENT, bufferSize)),
+                                                     &std::free);
+    if (!buffer) return false;
+    for (usize pos = 0; pos < length;) {
+        usize chunk = std::min(length - pos, bufferSize);
+        usize alignedChunk = (chunk + DIRECT_ALIGNMENT - 1) / DIRECT_ALIGNMENT * DIRECT_ALIGNMENT;
+        std::memcpy(buffer.get(), data + pos, chunk);
+        std::memset(buffer.get() + chunk, 0, alignedChunk - chunk);
+        if (!writeChunks(fd, buffer.get(), alignedChunk)) return false;
+        pos += chunk;
+    }
+    // drop padding of the last block
+    return ftruncate(fd, length) == 0;
+}
+
+// Makes rename durable, file systems that can't sync directories don't need it
+static bool syncParentDirectory(const fs::path& path) {
+    fs::path dir = path.parent_path();
+    int fd = open(dir.empty() ? "." : dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) return false;
+    bool success = fsync(fd) == 0 || errno == EINVAL;
+    close(fd);
+    return success;
+}
+
+void writeFileAtomic(const fs::path& requestedPath, const u8* data, usize length, bool direct) {
+    const fs::path path = resolveWriteTarget(requestedPath);
+    fs::path tempPath;
+    int flags = O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC;
+    int fd = -1;
+    for (u32 attempt = 0; attempt < 100 && fd < 0; attempt++) {
+        tempPath = getTemporaryPath(path);
+#ifdef O_DIRECT
+        if (direct) {
+            fd = open(tempPath.c_str(), flags | O_DIRECT, 0666);
+            // not every file system supports direct writes
+            if (fd < 0 && errno == EINVAL) {
+                direct = false;
+            }
+        }
+#else
+        direct = false;
+#endif
+        if (fd < 0 && !direct) {
+            fd = open(tempPath.c_str(), flags, 0666);
+        }
+        if (fd < 0 && errno != EEXIST) break;
+    }
+    if (fd < 0) {
+        bail("Failed to open file for writing");
+    }
+    // replaced file keeps its permissions, owner is not preserved
+    struct stat targetStat;
+    if (stat(path.c_str(), &targetStat) == 0) {
+        fchmod(fd, targetStat.st_mode & 07777);
+    }
+#ifdef __linux__
+    // reserve final size up front, failure only means the file system doesn't support it
+    if (length > 0) {
+        fallocate(fd, 0, 0, length);
+    }
+#endif
+    bool success = direct ? writeChunksDirect(fd, data, length) : writeChunks(fd, data, length);
+    success = success && fsync(fd) == 0;
+    success = close(fd) == 0 && success;
+    if (!success || rename(tempPath.c_str(), path.c_str()) != 0) {
+        unlink(tempPath.c_str());
+        bail("Failed to write file");
+    }
+    if (!syncParentDirectory(path)) {
+        bail("Failed to sync directory of written file");
+    }
+}
+#endif
+
+i64 ReadOnlyFile::length() const {
+    return fileLength;
+}
+
+bool MappedFile::good() const {
+    return opened;
+}
+
+const u8* MappedFile::data() const {
+    return mapped;
+}
+
+i64 MappedFile::length() const {
+    return fileLength;
+}
+
+FileView::FileView(const fs::path& path) : mapping(std::make_unique<MappedFile>(path)) {
+    if (mapping->good()) return;
+    mapping.reset();
+    ReadOnlyFile file(path);
+    if (!file.good()) {
+        bail("Failed to open file for reading");
+    }
+    buffer.resize(file.length());
+    file.readAt(0, buffer.data(), buffer.size());
+}
+
+const u8* FileView::data() const {
+    return mapping ? mapping->data() : buffer.data();
+}
+
+usize FileView::size() const {
+    return mapping ? mapping->length() : buffer.size();
+}
+
+void createEmptyFile(const fs::path& path) {
+    std::ofstream create(path, std::ios::binary | std::ios::trunc);
+}
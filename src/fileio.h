@@ -0,0 +1,66 @@
+#pragma once
+
+#include "platform.h"
+
+#include "bufferpool.h"
+
+// Read only file supporting reads at explicit offsets, safe to use from multiple threads at once
+class ReadOnlyFile {
+  public:
+    ReadOnlyFile(const fs::path& path);
+    ~ReadOnlyFile();
+    ReadOnlyFile(const ReadOnlyFile&) = delete;
+    ReadOnlyFile& operator=(const ReadOnlyFile&) = delete;
+    bool good() const;
+    i64 length() const;
+    void readAt(i64 offset, u8* buf, i64 len) const;
+
+  private:
+#ifdef _WIN32
+    HANDLE handle;
+#else
+    int fd;
+#endif
+    i64 fileLength;
+};
+
+// Read only memory mapping of whole file, mapped memory is valid for lifetime of the object
+class MappedFile {
+  public:
+    MappedFile(const fs::path& path);
+    ~MappedFile();
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    bool good() const;
+    const u8* data() const;
+    i64 length() const;
+
+  private:
+#ifdef _WIN32
+    HANDLE handle;
+    HANDLE mapping;
+#endif
+    const u8* mapped;
+    i64 fileLength;
+    bool opened;
+};
+
+// Read only contents of whole file. File is mapped when possible, otherwise it's read at once into pooled buffer.
+class FileView {
+  public:
+    FileView(const fs::path& path);
+    const u8* data() const;
+    usize size() const;
+
+  private:
+    std::unique_ptr<MappedFile> mapping;
+    PooledBuffer buffer;
+};
+
+// Writes file to temporary file in the same directory and renames it over the target once data is flushed, so the
+// target is either left untouched or fully written. Existing target keeps its permissions, when it's a symlink the
+// file it points to is replaced. Direct mode bypasses page cache where supported.
+void writeFileAtomic(const fs::path& path, const u8* data, usize length, bool direct = false);
+
+// Creates empty file, existing file is truncated
+void createEmptyFile(const fs::path& path);
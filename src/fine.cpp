@@ -1,13 +1,18 @@
 #include "fine.h"
 
 #include "spdlog/spdlog.h"
+#include "xxhash.h"
 extern "C" {
 #define WINVER _WIN32_WINNT
 #include "xdelta3.h"
 }
 
+#include "bufferpool.h"
 #include "platform.h"
+#include "sparse.h"
 #include "stream.h"
+#include "timeline.h"
+#include "vcdiff.h"
 
 fs::path getBuildDirectory(const fs::path& base) {
     const fs::path& buildDir = base / "build";
@@ -22,37 +27,33 @@ fs::path getBuildDirectory(const fs::path& base) {
 
 ByteBuffer readFile(const fs::path& path) {
     spdlog::debug("Read file '{}' into memory", path.u8string());
-    Stream file(path);
+    ReadOnlyFile file(path);
     if (!file.good()) {
         bail("Failed to open file for reading");
     }
     ByteBuffer buf(file.length());
-    if (!file.good()) {
-        bail("Failed to read file");
-    }
-    file.readFully(buf);
+    file.readAt(0, buf.data(), buf.size());
     return buf;
 }
 
-void writeFile(const fs::path& path, ByteBuffer buf) {
-    if (fs::exists(path)) {
-        fs::resize_file(path, 0);
-    } else {
-        std::ofstream touch(path);
-    }
+FileView readFileView(const fs::path& path) {
+    spdlog::debug("Open file '{}' view", path.u8string());
+    return FileView(path);
+}
+
+void writeFile(const fs::path& path, const ByteBuffer& buf) {
+    writeFile(path, buf.data(), buf.size());
+}
+
+void writeFile(const fs::path& path, const u8* data, usize length) {
     spdlog::debug("Write file '{}' from memory", path.u8string());
-    Stream file(path);
-    if (!file.good()) {
-        bail("Failed to open file for writing");
-    }
-    file.writeFully(buf);
-    if (!file.good()) {
-        bail("Failed to write file");
-    }
+    writeFileAtomic(path, data, length);
 }
 
-void copyFile(const fs::path& source, const fs::path& destination, std::function<void(usize, usize)> progressCallback) {
+void copyFile(const fs::path& source, const fs::path& destination, std::function<void(usize, usize)> progressCallback,
+              bool sparse) {
     spdlog::debug("Copy file '{}' -> '{}'", source.u8string(), destination.u8string());
+    TIMELINE_SCOPE("copyFile");
     char buf[8192];
 
     FILE* src;
@@ -76,13 +77,24 @@ void copyFile(const fs::path& source, const fs::path& destination, std::function
         bail("Copy failed, failed to open destination file");
     }
 
-    fseek(src, 0, SEEK_END);
-    usize totalSize = ftell(src);
-    fseek(src, 0, SEEK_SET);
+    // ftell is limited to 32 bits on Windows
+    usize totalSize = fs::file_size(source);
     usize readSize;
     usize progressSize = 0;
-    while ((readSize = fread(buf, 1, BUFSIZ, src))) {
-        fwrite(buf, 1, readSize, dest);
+    while ((readSize = fread(buf, 1, sizeof(buf), src))) {
+        if (sparse) {
+            // zero blocks are skipped, destination is a new file so holes read back as zeros
+            for (usize offset = 0; offset < readSize; offset += SPARSE_BLOCK_SIZE) {
+                usize blockSize = std::min<usize>(readSize - offset, SPARSE_BLOCK_SIZE);
+                if (blockSize == SPARSE_BLOCK_SIZE && isZeroFilled(reinterpret_cast<u8*>(buf + offset), blockSize)) {
+                    fseek(dest, blockSize, SEEK_CUR);
+                } else {
+                    fwrite(buf + offset, 1, blockSize, dest);
+                }
+            }
+        } else {
+            fwrite(buf, 1, readSize, dest);
+        }
         progressSize += readSize;
         progressCallback(progressSize, totalSize);
     }
@@ -91,37 +103,253 @@ void copyFile(const fs::path& source, const fs::path& destination, std::function
     }
     fclose(src);
     fclose(dest);
+    if (sparse) {
+        // trailing zero blocks were skipped
+        fs::resize_file(destination, progressSize);
+    }
 }
 
-static int MAX_BUFFER_SIZE = 64 * 1024 * 1024;
+// Source is read in blocks on demand, cache bounds memory used for source data during streaming
+static const usize_t XDELTA_SOURCE_BLOCK_SIZE = 1 << 20;
+static const u32 XDELTA_SOURCE_CACHE_BLOCKS = 64;
 
-void createPatch(const fs::path& source, const fs::path& target, const fs::path& patch) {
-    spdlog::debug("Create patch '{}' -> '{}', save patch to '{}'", source.u8string(), target.u8string(), patch.u8string());
-    ByteBuffer sourceBuf = readFile(source);
-    ByteBuffer targetBuf = readFile(target);
-    ByteBuffer patchBuf(MAX_BUFFER_SIZE);
-    u32 usedPatchSize;
-    i32 result = xd3_encode_memory(targetBuf.data(), targetBuf.size(), sourceBuf.data(), sourceBuf.size(), patchBuf.data(),
-                                   &usedPatchSize, patchBuf.size(), XD3_ADLER32);
-    spdlog::trace("Xdelta result: {}", result);
+class XdeltaSourceReader {
+  public:
+    XdeltaSourceReader(Stream& stream) : stream(stream), length(stream.length()), useCounter(0) {
+    }
+
+    int getBlock(xd3_source* source, xoff_t blockNumber) {
+        CachedBlock* block = findBlock(blockNumber);
+        if (block == nullptr) {
+            block = &evictBlock();
+            i64 offset = blockNumber * XDELTA_SOURCE_BLOCK_SIZE;
+            block->number = blockNumber;
+            block->length = std::max<i64>(0, std::min<i64>(XDELTA_SOURCE_BLOCK_SIZE, length - offset));
+            block->data.resize(XDELTA_SOURCE_BLOCK_SIZE);
+            stream.seek(offset);
+            stream.readFully(block->data.data(), block->length);
+            if (!stream.good()) {
+                spdlog::error("Failed to read xdelta source block {}", blockNumber);
+                block->lastUse = 0;
+                return XD3_INVALID_INPUT;
+            }
+        }
+        block->lastUse = ++useCounter;
+        source->curblkno = blockNumber;
+        source->onblk = block->length;
+        source->curblk = block->data.data();
+        return 0;
+    }
+
+  private:
+    struct CachedBlock {
+        xoff_t number;
+        usize_t length;
+        u64 lastUse;
+        ByteBuffer data;
+    };
+
+    CachedBlock* findBlock(xoff_t blockNumber) {
+        for (auto& block : blocks) {
+            if (block.number == blockNumber && block.lastUse != 0) return &block;
+        }
+        return nullptr;
+    }
+
+    CachedBlock& evictBlock() {
+        if (blocks.size() < XDELTA_SOURCE_CACHE_BLOCKS) {
+            blocks.emplace_back(CachedBlock{0, 0, 0, ByteBuffer()});
+            return blocks.back();
+        }
+        return *std::min_element(blocks.begin(), blocks.end(),
+                                 [](const CachedBlock& a, const CachedBlock& b) { return a.lastUse < b.lastUse; });
+    }
+
+    Stream& stream;
+    const i64 length;
+    u64 useCounter;
+    std::vector<CachedBlock> blocks;
+};
+
+static int xdeltaGetBlock(__attribute__((unused)) xd3_stream* stream, xd3_source* source, xoff_t blockNumber) {
+    // exceptions must not unwind through xdelta C code
+    try {
+        return static_cast<XdeltaSourceReader*>(source->ioh)->getBlock(source, blockNumber);
+    } catch (const std::runtime_error&) {
+        return XD3_INTERNAL;
+    }
+}
+
+static void runXdeltaStream(Stream& source, Stream& input, std::function<void(const u8*, usize)> output,
+                            xd3_config& config, bool encode) {
+    XdeltaSourceReader sourceReader(source);
+    config.getblk = xdeltaGetBlock;
+    xd3_stream stream;
+    std::memset(&stream, 0, sizeof(stream));
+    // output callback may throw, stream is freed on every path
+    std::unique_ptr<xd3_stream, decltype(&xd3_free_stream)> streamGuard(&stream, &xd3_free_stream);
+    if (xd3_config_stream(&stream, &config) != 0) {
+        spdlog::error("Xdelta stream config failed: {}", xd3_errstring(&stream));
+        bail("Xdelta failed");
+    }
+    xd3_source xsource;
+    std::memset(&xsource, 0, sizeof(xsource));
+    xsource.blksize = XDELTA_SOURCE_BLOCK_SIZE;
+    xsource.name = "source";
+    xsource.ioh = &sourceReader;
+    xsource.max_winsize = (xoff_t)XDELTA_SOURCE_BLOCK_SIZE * XDELTA_SOURCE_CACHE_BLOCKS;
+    // without source xdelta only compresses the input
+    if (source.length() > 0) {
+        xd3_set_source_and_size(&stream, &xsource, source.length());
+    }
+
+    PooledBuffer inputBuf(config.winsize);
+    i64 remaining = input.length() - input.pos();
+    i32 result = 0;
+    do {
+        usize_t readSize = std::min<i64>(remaining, inputBuf.size());
+        input.readFully(inputBuf.data(), readSize);
+        if (!input.good()) {
+            result = XD3_INVALID_INPUT;
+            break;
+        }
+        remaining -= readSize;
+        if (remaining == 0) {
+            xd3_set_flags(&stream, XD3_FLUSH | stream.flags);
+        }
+        xd3_avail_input(&stream, inputBuf.data(), readSize);
+        while (true) {
+            result = encode ? xd3_encode_input(&stream) : xd3_decode_input(&stream);
+            if (result == XD3_INPUT) {
+                break;
+            } else if (result == XD3_OUTPUT) {
+                output(stream.next_out, stream.avail_out);
+                xd3_consume_output(&stream);
+            } else if (result != XD3_GOTHEADER && result != XD3_WINSTART && result != XD3_WINFINISH) {
+                break;
+            }
+        }
+    } while (result == XD3_INPUT && remaining > 0);
+
+    if (result != XD3_INPUT) {
+        spdlog::error("Xdelta returned unexpected result: {} ({})", result, xd3_errstring(&stream));
+        bail("Xdelta failed");
+    }
+    // input ending in the middle of a window is only reported on close
+    result = xd3_close_stream(&stream);
     if (result != 0) {
-        spdlog::error("Xdelta returned non zero result: {}", result);
+        spdlog::error("Xdelta stream close failed: {} ({})", result, xd3_errstring(&stream));
         bail("Xdelta failed");
     }
-    patchBuf.resize(usedPatchSize);
-    writeFile(patch, patchBuf);
 }
 
-void applyPatch(const fs::path& source, const fs::path& target, const ByteBuffer patch) {
+static void runXdeltaStream(Stream& source, Stream& input, Stream& output, xd3_config& config, bool encode) {
+    runXdeltaStream(
+        source, input, [&output](const u8* data, usize len) { output.writeFully(data, len); }, config, encode);
+    if (!output.good()) {
+        bail("Failed to write xdelta output");
+    }
+}
+
+static void initEncoderConfig(xd3_config& config, const XdeltaSettings& settings) {
+    i32 flags = XD3_ADLER32;
+    if (settings.secondary == XdeltaSecondary::Djw) {
+        flags |= XD3_SEC_DJW;
+    } else if (settings.secondary == XdeltaSecondary::Fgk) {
+        flags |= XD3_SEC_FGK;
+    }
+    if (settings.level > 9) {
+        bail("Xdelta compression level must be <= 9");
+    }
+    flags |= settings.level << XD3_COMPLEVEL_SHIFT;
+    xd3_init_config(&config, flags);
+    config.winsize = std::max<u32>(settings.windowSize, XD3_ALLOCSIZE);
+}
+
+void createPatch(const fs::path& source, const fs::path& target, const fs::path& patch) {
+    spdlog::debug("Create patch '{}' -> '{}', save patch to '{}'", source.u8string(), target.u8string(), patch.u8string());
+    Stream sourceStream(source, true);
+    Stream targetStream(target, true);
+    if (!sourceStream.good() || !targetStream.good()) {
+        bail("Failed to open file for reading");
+    }
+    createEmptyFile(patch);
+    Stream patchStream(patch);
+    if (!patchStream.good()) {
+        bail("Failed to open file for writing");
+    }
+    createPatch(sourceStream, targetStream, patchStream);
+}
+
+void createPatch(Stream& source, Stream& target, Stream& patch, const XdeltaSettings& settings) {
+    xd3_config config;
+    initEncoderConfig(config, settings);
+    runXdeltaStream(source, target, patch, config, true);
+}
+
+ByteBuffer createPatch(const u8* source, usize sourceLen, const u8* target, usize targetLen,
+                       const XdeltaSettings& settings) {
+    // streams are only read from
+    Stream sourceStream(const_cast<u8*>(source), sourceLen);
+    Stream targetStream(const_cast<u8*>(target), targetLen);
+    xd3_config config;
+    initEncoderConfig(config, settings);
+    ByteBuffer patch;
+    runXdeltaStream(
+        sourceStream, targetStream, [&patch](const u8* data, usize len) { patch.insert(patch.end(), data, data + len); },
+        config, true);
+    return patch;
+}
+
+void applyPatch(const fs::path& source, const fs::path& target, const ByteBuffer& patch,
+                std::optional<u64> expectedHash) {
     spdlog::debug("Apply patch on '{}' -> '{}'", source.u8string(), target.u8string());
     ByteBuffer targetBuf = applyPatch(source, patch);
+    verifyOutputHash(target.u8string(), targetBuf.data(), targetBuf.size(), expectedHash);
     writeFile(target, targetBuf);
 }
 
+static void checkOutputHash(const std::string& name, u64 hash, u64 expectedHash) {
+    if (hash != expectedHash) {
+        spdlog::error("Patched '{}' has hash {:016x}, expected {:016x}", name, hash, expectedHash);
+        bail("Patched file verification failed");
+    }
+}
+
+void verifyOutputHash(const std::string& name, const u8* data, usize length, std::optional<u64> expectedHash) {
+    if (expectedHash) {
+        checkOutputHash(name, XXH3_64bits(data, length), *expectedHash);
+    }
+}
+
+void applyPatch(Stream& source, Stream& target, Stream& patch, std::optional<u64> expectedHash) {
+    TIMELINE_SCOPE("applyPatch");
+    xd3_config config;
+    xd3_init_config(&config, 0);
+    config.winsize = XD3_DEFAULT_WINSIZE;
+    if (!expectedHash) {
+        runXdeltaStream(source, patch, target, config, false);
+        return;
+    }
+    std::unique_ptr<XXH3_state_t, decltype(&XXH3_freeState)> state(XXH3_createState(), &XXH3_freeState);
+    XXH3_64bits_reset(state.get());
+    runXdeltaStream(
+        source, patch,
+        [&target, &state](const u8* data, usize len) {
+            XXH3_64bits_update(state.get(), data, len);
+            target.writeFully(data, len);
+        },
+        config, false);
+    if (!target.good()) {
+        bail("Failed to write xdelta output");
+    }
+    checkOutputHash("xdelta output", XXH3_64bits_digest(state.get()), *expectedHash);
+}
+
 ByteBuffer applyPatch(const fs::path& source, const ByteBuffer& patch) {
     spdlog::debug("Apply patch on '{}'", source.u8string());
-    ByteBuffer sourceBuf = readFile(source);
-    return applyPatch(sourceBuf, patch);
+    FileView sourceView = readFileView(source);
+    return applyPatch(sourceView.data(), sourceView.size(), patch.data(), patch.size());
 }
 
 ByteBuffer applyPatch(const ByteBuffer& source, const ByteBuffer& patch) {
@@ -129,16 +357,30 @@ ByteBuffer applyPatch(const ByteBuffer& source, const ByteBuffer& patch) {
 }
 
 ByteBuffer applyPatch(const u8* source, usize sourceLen, const u8* patch, usize patchLen) {
-    ByteBuffer outputBuf(MAX_BUFFER_SIZE);
-    u32 usedOutBufSize;
-    i32 result =
-        xd3_decode_memory(patch, patchLen, source, sourceLen, outputBuf.data(), &usedOutBufSize, outputBuf.size(), 0);
+    // checked before the buffer is allocated, corrupt window headers can declare any size
+    u64 targetSize = getVcdiffTargetSize(patch, patchLen);
+    if (targetSize > UINT32_MAX) {
+        bail("Input is too large for in-memory patching");
+    }
+    ByteBuffer outputBuf(targetSize);
+    if (outputBuf.empty()) return outputBuf;
+    usize usedOutBufSize = applyPatch(source, sourceLen, patch, patchLen, outputBuf.data(), outputBuf.size());
+    outputBuf.resize(usedOutBufSize);
+    return outputBuf;
+}
+
+usize applyPatch(const u8* source, usize sourceLen, const u8* patch, usize patchLen, u8* dest, usize destLen) {
+    TIMELINE_SCOPE("applyPatch");
+    if (sourceLen > UINT32_MAX || patchLen > UINT32_MAX || destLen > UINT32_MAX) {
+        bail("Input is too large for in-memory patching");
+    }
+    usize_t usedOutBufSize;
+    i32 result = xd3_decode_memory(patch, patchLen, source, sourceLen, dest, &usedOutBufSize, destLen, 0);
     if (result != 0) {
         spdlog::error("Xdelta returned non zero result: {}", result);
         bail("Xdelta failed");
     }
-    outputBuf.resize(usedOutBufSize);
-    return outputBuf;
+    return usedOutBufSize;
 }
 
 bool endsWith(const std::string& str, const std::string& suffix) {
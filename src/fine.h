@@ -1,17 +1,47 @@
 #pragma once
 
+#include <optional>
+
+#include "fileio.h"
 #include "platform.h"
+#include "stream.h"
+
+enum class XdeltaSecondary { None, Djw, Fgk };
+
+class XdeltaSettings {
+  public:
+    u32 windowSize = 8 * 1024 * 1024;
+    XdeltaSecondary secondary = XdeltaSecondary::None;
+    // 1-9, higher levels are slower but produce smaller patches, 0 keeps xdelta default
+    u32 level = 0;
+};
 
 fs::path getBuildDirectory(const fs::path& base);
 
 ByteBuffer readFile(const fs::path& path);
-void writeFile(const fs::path& path, ByteBuffer buf);
-void copyFile(const fs::path& source, const fs::path& destination, std::function<void(usize, usize)> progressCallback);
+// Cheaper than readFile for large files, contents are mapped when possible instead of being copied
+FileView readFileView(const fs::path& path);
+void writeFile(const fs::path& path, const ByteBuffer& buf);
+void writeFile(const fs::path& path, const u8* data, usize length);
+// Zero filled blocks are skipped by default, copies of disc images with padding take less space and write less
+void copyFile(const fs::path& source, const fs::path& destination, std::function<void(usize, usize)> progressCallback,
+              bool sparse = true);
 
 void createPatch(const fs::path& target, const fs::path& source, const fs::path& patch);
-void applyPatch(const fs::path& source, const fs::path& target, const ByteBuffer patch);
+void createPatch(Stream& source, Stream& target, Stream& patch, const XdeltaSettings& settings = XdeltaSettings());
+ByteBuffer createPatch(const u8* source, usize sourceLen, const u8* target, usize targetLen,
+                       const XdeltaSettings& settings = XdeltaSettings());
+// Expected hash is XXH3 64 bit hash of patched output, mismatch fails before output replaces target file
+void applyPatch(const fs::path& source, const fs::path& target, const ByteBuffer& patch,
+                std::optional<u64> expectedHash = std::nullopt);
+// Expected hash is checked incrementally as output is written
+void applyPatch(Stream& source, Stream& target, Stream& patch, std::optional<u64> expectedHash = std::nullopt);
 ByteBuffer applyPatch(const fs::path& source, const ByteBuffer& patch);
 ByteBuffer applyPatch(const ByteBuffer& source, const ByteBuffer& patch);
 ByteBuffer applyPatch(const u8* source, usize sourceLen, const u8* patch, usize patchLen);
+usize applyPatch(const u8* source, usize sourceLen, const u8* patch, usize patchLen, u8* dest, usize destLen);
+
+// Bails when expected hash is present and doesn't match XXH3 64 bit hash of data
+void verifyOutputHash(const std::string& name, const u8* data, usize length, std::optional<u64> expectedHash);
 
 bool endsWith(const std::string& str, const std::string& suffix);
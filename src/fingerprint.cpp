@@ -0,0 +1,126 @@
+#include "fingerprint.h"
+
+#include <iomanip>
+
+#include "spdlog/spdlog.h"
+
+#include "bufferpool.h"
+#include "fileio.h"
+#include "iso9660.h"
+#include "stream.h"
+#include "taskpool.h"
+
+// Volume descriptors start at sector 16, terminator is expected well before this limit
+static const u32 ISO_DESCRIPTORS_START = 16;
+static const u32 ISO_MAX_DESCRIPTORS = 64;
+static const u32 ISO_SAMPLE_COUNT = 256;
+static const i64 ISO_SAMPLE_SIZE = 64 * 1024;
+
+static void updateLength(XXH3_state_t* state, i64 length) {
+    u8 bytes[8];
+    Stream(bytes, sizeof(bytes)).writeLong(length);
+    XXH3_128bits_update(state, bytes, sizeof(bytes));
+}
+
+XXH128_hash_t fingerprintFile(const fs::path& path, u32 threads) {
+    spdlog::debug("Fingerprint file '{}'", path.u8string());
+    MappedFile mapping(path);
+    ReadOnlyFile file(path);
+    if (!file.good()) {
+        bail("Failed to open file for reading");
+    }
+    i64 length = file.length();
+    usize chunks = (length + FINGERPRINT_CHUNK_SIZE - 1) / FINGERPRINT_CHUNK_SIZE;
+    // chunk hashes are stored little endian so fingerprint doesn't depend on platform
+    ByteBuffer leaves(chunks * 16);
+    TaskPool pool(threads);
+    for (usize chunk = 0; chunk < chunks; chunk++) {
+        pool.submit([&, chunk] {
+            i64 offset = chunk * FINGERPRINT_CHUNK_SIZE;
+            i64 chunkSize = std::min(FINGERPRINT_CHUNK_SIZE, length - offset);
+            XXH128_hash_t hash;
+            if (mapping.good() && mapping.length() == length) {
+                hash = XXH3_128bits(mapping.data() + offset, chunkSize);
+            } else {
+                PooledBuffer buffer(chunkSize);
+                file.readAt(offset, buffer.data(), chunkSize);
+                hash = XXH3_128bits(buffer.data(), chunkSize);
+            }
+            Stream leaf(leaves.data() + chunk * 16, 16);
+            leaf.writeLong(hash.low64);
+            leaf.writeLong(hash.high64);
+        });
+    }
+    pool.wait();
+
+    XXH3_state_t* state = XXH3_createState();
+    XXH3_128bits_reset(state);
+    XXH3_128bits_update(state, leaves.data(), leaves.size());
+    updateLength(state, length);
+    XXH128_hash_t hash = XXH3_128bits_digest(state);
+    XXH3_freeState(state);
+    return hash;
+}
+
+XXH128_hash_t fingerprintIsoSampled(const fs::path& path) {
+    spdlog::debug("Fingerprint ISO '{}' using samples", path.u8string());
+    ReadOnlyFile file(path);
+    if (!file.good()) {
+        bail("Failed to open file for reading");
+    }
+    i64 length = file.length();
+    XXH3_state_t* state = XXH3_createState();
+    XXH3_128bits_reset(state);
+    updateLength(state, length);
+    auto hashRange = [&](i64 offset, i64 size) {
+        size = std::min(size, length - offset);
+        if (offset < 0 || size <= 0) return ByteBuffer();
+        ByteBuffer data(size);
+        file.readAt(offset, data.data(), size);
+        XXH3_128bits_update(state, data.data(), size);
+        return data;
+    };
+
+    u8 sector[ISO_SECTOR_SIZE];
+    u32 pathTableSize = 0;
+    u32 pathTableLba = 0;
+    for (u32 i = 0; i < ISO_MAX_DESCRIPTORS; i++) {
+        i64 offset = static_cast<i64>(ISO_DESCRIPTORS_START + i) * ISO_SECTOR_SIZE;
+        if (offset + ISO_SECTOR_SIZE > length) break;
+        file.readAt(offset, sector, ISO_SECTOR_SIZE);
+        XXH3_128bits_update(state, sector, ISO_SECTOR_SIZE);
+        if (sector[0] == 1) {
+            Stream descriptor(sector, ISO_SECTOR_SIZE);
+            descriptor.seek(132);
+            pathTableSize = descriptor.readInt();
+            descriptor.seek(140);
+            pathTableLba = descriptor.readInt();
+        } else if (sector[0] == 255) {
+            break;
+        }
+    }
+
+    // every path table entry points to a directory extent, its first sector holds the start of directory records
+    ByteBuffer pathTable = hashRange(static_cast<i64>(pathTableLba) * ISO_SECTOR_SIZE, pathTableSize);
+    Stream pathTableStream(pathTable);
+    for (usize pos = 0; pos + 8 <= pathTable.size();) {
+        u8 nameLength = pathTable[pos];
+        pathTableStream.seek(pos + 2);
+        u32 lba = pathTableStream.readInt();
+        hashRange(static_cast<i64>(lba) * ISO_SECTOR_SIZE, ISO_SECTOR_SIZE);
+        pos += 8 + nameLength + (nameLength % 2);
+    }
+
+    for (u32 i = 0; i < ISO_SAMPLE_COUNT && length > ISO_SAMPLE_SIZE; i++) {
+        hashRange((length - ISO_SAMPLE_SIZE) / (ISO_SAMPLE_COUNT - 1) * i, ISO_SAMPLE_SIZE);
+    }
+    XXH128_hash_t hash = XXH3_128bits_digest(state);
+    XXH3_freeState(state);
+    return hash;
+}
+
+std::string formatFingerprint(const XXH128_hash_t& hash) {
+    std::ostringstream ss;
+    ss << std::hex << std::setfill('0') << std::setw(16) << hash.high64 << std::setw(16) << hash.low64;
+    return ss.str();
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include "platform.h"
+
+#include "xxhash.h"
+
+// Chunk size of full fingerprint tree hash, changing it changes all fingerprints
+const i64 FINGERPRINT_CHUNK_SIZE = 4 * 1024 * 1024;
+
+// Hashes whole file in chunks on multiple threads, chunk hashes are combined with file length into final hash.
+// threads set to 0 uses hardware concurrency.
+XXH128_hash_t fingerprintFile(const fs::path& path, u32 threads = 0);
+// Fast fingerprint of ISO image hashing only volume descriptors, path table, first sector of each directory and evenly
+// spaced samples of the image. Directory records contain location and size of all files so any relocated or resized
+// file changes the fingerprint, in-place edits are only caught when they hit a sample.
+XXH128_hash_t fingerprintIsoSampled(const fs::path& path);
+std::string formatFingerprint(const XXH128_hash_t& hash);
@@ -0,0 +1,64 @@
+#include "iostats.h"
+
+#include <mutex>
+
+#include "spdlog/spdlog.h"
+
+// Number of streams listed individually in summary
+static const usize IO_STATS_DUMP_LIMIT = 20;
+
+// Function local so that streams can be created during static initialization
+class IoStatsRegistry {
+  public:
+    static IoStatsRegistry& get() {
+        static IoStatsRegistry instance;
+        return instance;
+    }
+    std::mutex mutex;
+    std::map<std::string, std::unique_ptr<IoStats>> stats;
+};
+
+IoStats::IoStats(const std::string& name)
+    : name(name), bytesRead(0), bytesWritten(0), reads(0), writes(0), seeks(0), blockedNanos(0) {
+}
+
+void IoStats::add(const IoCounters& counters) {
+    bytesRead.fetch_add(counters.bytesRead, std::memory_order_relaxed);
+    bytesWritten.fetch_add(counters.bytesWritten, std::memory_order_relaxed);
+    reads.fetch_add(counters.reads, std::memory_order_relaxed);
+    writes.fetch_add(counters.writes, std::memory_order_relaxed);
+    seeks.fetch_add(counters.seeks, std::memory_order_relaxed);
+    blockedNanos.fetch_add(counters.blockedNanos, std::memory_order_relaxed);
+}
+
+IoStats* IoStats::get(const std::string& name) {
+    auto& registry = IoStatsRegistry::get();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    auto& stats = registry.stats[name];
+    if (!stats) {
+        stats = std::make_unique<IoStats>(name);
+    }
+    return stats.get();
+}
+
+void IoStats::dump() {
+    auto& registry = IoStatsRegistry::get();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    std::vector<const IoStats*> sorted;
+    for (const auto& entry : registry.stats) {
+        sorted.push_back(entry.second.get());
+    }
+    std::sort(sorted.begin(), sorted.end(), [](const auto* a, const auto* b) {
+        return a->blockedNanos.load(std::memory_order_relaxed) > b->blockedNanos.load(std::memory_order_relaxed);
+    });
+    spdlog::info("I/O statistics of {} streams:", sorted.size());
+    for (usize i = 0; i < sorted.size() && i < IO_STATS_DUMP_LIMIT; i++) {
+        const IoStats* stats = sorted[i];
+        spdlog::info("  '{}': read {} bytes in {} calls, wrote {} bytes in {} calls, {} seeks, {:.1f} ms in I/O",
+                     stats->name, stats->bytesRead.load(), stats->reads.load(), stats->bytesWritten.load(),
+                     stats->writes.load(), stats->seeks.load(), stats->blockedNanos.load() / 1e6);
+    }
+    if (sorted.size() > IO_STATS_DUMP_LIMIT) {
+        spdlog::info("  and {} more streams", sorted.size() - IO_STATS_DUMP_LIMIT);
+    }
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include "platform.h"
+
+#include <atomic>
+#include <chrono>
+
+// Counters of single stream. Streams are not shared between threads so counting doesn't need atomics, counters are
+// added to shared statistics once the stream is closed.
+class IoCounters {
+  public:
+    void countRead(u64 bytes) {
+        reads++;
+        bytesRead += bytes;
+    }
+    void countWrite(u64 bytes) {
+        writes++;
+        bytesWritten += bytes;
+    }
+    void countSeek() {
+        seeks++;
+    }
+    u64 bytesRead = 0;
+    u64 bytesWritten = 0;
+    u64 reads = 0;
+    u64 writes = 0;
+    u64 seeks = 0;
+    u64 blockedNanos = 0;
+};
+
+// I/O statistics of file streams, streams opened on the same path share statistics. Statistics are never freed so
+// streams can keep plain pointers to them. Memory streams are not counted.
+class IoStats {
+  public:
+    IoStats(const std::string& name);
+    void add(const IoCounters& counters);
+    static IoStats* get(const std::string& name);
+    // Logs summary of streams that spent most time in I/O, streams that are still open are not included
+    static void dump();
+    const std::string name;
+    std::atomic<u64> bytesRead;
+    std::atomic<u64> bytesWritten;
+    std::atomic<u64> reads;
+    std::atomic<u64> writes;
+    std::atomic<u64> seeks;
+    std::atomic<u64> blockedNanos;
+};
+
+class IoTimer {
+  public:
+    IoTimer(IoCounters& counters) : counters(counters), start(std::chrono::steady_clock::now()) {
+    }
+    ~IoTimer() {
+        counters.blockedNanos +=
+            std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+    }
+
+  private:
+    IoCounters& counters;
+    const std::chrono::steady_clock::time_point start;
+};
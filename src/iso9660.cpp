@@ -2,6 +2,7 @@
 
 #include "spdlog/spdlog.h"
 #include "stream.h"
+#include "timeline.h"
 
 IsoPrimaryVolumeDescriptor::IsoPrimaryVolumeDescriptor(Stream& input) {
     if (input.readString(5) != "CD001") {
@@ -217,6 +218,7 @@ std::string IsoPathTable::getRelPath(const IsoPathTableEntry& entry) {
 }
 
 Iso9660Reader::Iso9660Reader(const fs::path& iso) : stream(iso, true) {
+    TIMELINE_SCOPE("Iso9660Reader");
     spdlog::info("Reading ISO: '{}'", iso.u8string());
     i64 length = stream.length();
     if (!stream.good()) {
@@ -243,11 +245,11 @@ Iso9660Reader::Iso9660Reader(const fs::path& iso) : stream(iso, true) {
         }
         stream.seek(sectorStart + ISO_SECTOR_SIZE);
     }
-    stream.seek(primaryDescriptor->getPathTableLba() * ISO_SECTOR_SIZE);
+    stream.seek(static_cast<i64>(primaryDescriptor->getPathTableLba()) * ISO_SECTOR_SIZE);
     pathTable = std::make_unique<IsoPathTable>(stream, primaryDescriptor->getPathTableSize());
     for (auto& entry : pathTable->getEntries()) {
         std::string relPath = pathTable->getRelPath(entry);
-        stream.seek(entry.lba * ISO_SECTOR_SIZE);
+        stream.seek(static_cast<i64>(entry.lba) * ISO_SECTOR_SIZE);
         records.emplace_back(stream, relPath);
     }
 }
@@ -4,6 +4,8 @@
 #include "stream.h"
 
 const u32 ISO_SECTOR_SIZE = 2048;
+// File flag of directory records, other flags like hidden or multi-extent are set on regular files too
+const u8 ISO_ATTRIBUTE_DIRECTORY = 0x02;
 
 class IsoPrimaryVolumeDescriptor {
   public:
@@ -1,23 +1,52 @@
 #include "isoutils.h"
 
+#include "bufferpool.h"
 #include "fine.h"
 #include "spdlog/spdlog.h"
+#include "timeline.h"
+#include "vcdiff.h"
 
-ByteBuffer stashIsoPrimaryDescriptor(Stream& iso) {
+// Gaps between source segments smaller than this are read through instead of seeking over
+static const u64 SOURCE_SEGMENT_MERGE_GAP = 64 * 1024;
+
+ByteBuffer stashIsoPrimaryDescriptor(Stream& iso, PatchJournal* journal) {
     spdlog::trace("Remove ISO primary volume descriptor");
-    ByteBuffer blank(ISO_SECTOR_SIZE);
+    std::optional<ByteBuffer> recorded;
+    if (journal != nullptr) {
+        recorded = journal->getDescriptor();
+    }
     ByteBuffer descriptor(ISO_SECTOR_SIZE);
+    if (recorded) {
+        descriptor = *recorded;
+    } else {
+        iso.seek(16 * ISO_SECTOR_SIZE);
+        iso.readFully(descriptor);
+        if (journal != nullptr) {
+            journal->setDescriptor(descriptor);
+        }
+    }
     iso.seek(16 * ISO_SECTOR_SIZE);
-    iso.readFully(descriptor);
-    iso.seek(16 * ISO_SECTOR_SIZE);
-    iso.writeFully(blank);
+    iso.writeZeros(ISO_SECTOR_SIZE);
     return descriptor;
 }
 
-void restoreIsoPrimaryDescriptor(Stream& iso, ByteBuffer descriptor) {
+void restoreIsoPrimaryDescriptor(Stream& iso, ByteBuffer descriptor, PatchJournal* journal) {
     spdlog::trace("Restore ISO primary volume descriptor");
     iso.seek(16 * ISO_SECTOR_SIZE);
     iso.writeFully(descriptor);
+    if (journal != nullptr) {
+        iso.flush();
+        journal->finish();
+    }
+}
+
+void recoverIsoPrimaryDescriptor(Stream& iso, PatchJournal& journal) {
+    auto descriptor = journal.getDescriptor();
+    if (!descriptor) return;
+    spdlog::info("Recover ISO primary volume descriptor of interrupted run");
+    iso.seek(16 * ISO_SECTOR_SIZE);
+    iso.writeFully(*descriptor);
+    iso.flush();
 }
 
 std::vector<IsoDirectoryRecord> getIsoRecords(const fs::path& iso) {
@@ -31,9 +60,9 @@ IsoDirectoryRecordEntry seekToIsoFile(Stream& iso, const std::vector<IsoDirector
     spdlog::trace("Seek to ISO file: '{}'", relPath);
     for (const auto& record : records) {
         for (const auto& entry : record.getEntries()) {
-            if (entry.relPath == relPath && entry.atributes == 0) {
+            if (entry.relPath == relPath && (entry.atributes & ISO_ATTRIBUTE_DIRECTORY) == 0) {
                 spdlog::trace("Found file at LBA: {}", entry.lba);
-                iso.seek(entry.lba * ISO_SECTOR_SIZE);
+                iso.seek(static_cast<i64>(entry.lba) * ISO_SECTOR_SIZE);
                 return entry;
             }
         }
@@ -43,39 +72,186 @@ IsoDirectoryRecordEntry seekToIsoFile(Stream& iso, const std::vector<IsoDirector
     __builtin_unreachable();
 }
 
+// Returns ranges of source that were read
+static std::vector<std::pair<u64, u64>> readPatchSourceSegments(Stream& iso, const IsoDirectoryRecordEntry& record,
+                                                                const ByteBuffer& patch, PooledBuffer& source) {
+    std::vector<std::pair<u64, u64>> segments;
+    for (const auto& window : readVcdiffWindows(patch.data(), patch.size())) {
+        if (!window.copiesFromSource() || window.segmentPosition >= record.length) continue;
+        u64 end = std::min<u64>(window.segmentPosition + window.segmentLength, record.length);
+        segments.emplace_back(window.segmentPosition, end);
+    }
+    std::sort(segments.begin(), segments.end());
+    std::vector<std::pair<u64, u64>> merged;
+    for (const auto& segment : segments) {
+        if (!merged.empty() && segment.first <= merged.back().second + SOURCE_SEGMENT_MERGE_GAP) {
+            merged.back().second = std::max(merged.back().second, segment.second);
+        } else {
+            merged.push_back(segment);
+        }
+    }
+    u64 readSize = 0;
+    for (const auto& range : merged) {
+        iso.seek(static_cast<i64>(record.lba) * ISO_SECTOR_SIZE + range.first);
+        iso.readFully(source.data() + range.first, range.second - range.first);
+        readSize += range.second - range.first;
+    }
+    spdlog::trace("Read {} of {} source bytes in {} ranges", readSize, record.length, merged.size());
+    return merged;
+}
+
+// Cache key covers the patch and only the source ranges it references, other source bytes don't affect the output.
+// Journal uses it to detect source already overwritten by interrupted run.
+static XXH128_hash_t getPatchCacheKey(const PooledBuffer& source, const std::vector<std::pair<u64, u64>>& ranges,
+                                      const ByteBuffer& patch) {
+    XXH3_state_t* state = XXH3_createState();
+    XXH3_128bits_reset(state);
+    XXH3_128bits_update(state, patch.data(), patch.size());
+    for (const auto& range : ranges) {
+        u64 bounds[2] = {range.first, range.second};
+        XXH3_128bits_update(state, bounds, sizeof(bounds));
+        XXH3_128bits_update(state, source.data() + range.first, range.second - range.first);
+    }
+    XXH128_hash_t key = XXH3_128bits_digest(state);
+    XXH3_freeState(state);
+    return key;
+}
+
+static u64 hashIsoExtent(Stream& iso, u32 lba, u64 length) {
+    PooledBuffer data(length);
+    iso.seek(static_cast<i64>(lba) * ISO_SECTOR_SIZE);
+    iso.readFully(data.data(), data.size());
+    return XXH3_64bits(data.data(), data.size());
+}
+
+// Checks that directory record at given offset points to extent with recorded output
+static bool isIsoRecordOutput(Stream& iso, i64 recordOffset, const PatchJournalOutput& output) {
+    iso.seek(recordOffset + 2);
+    u32 lba = iso.readInt();
+    iso.seek(recordOffset + 2 + 8);
+    u32 length = iso.readInt();
+    return length == output.length && hashIsoExtent(iso, lba, length) == output.hash;
+}
+
+static bool isSameKey(const XXH128_hash_t& a, const XXH128_hash_t& b) {
+    return a.low64 == b.low64 && a.high64 == b.high64;
+}
+
+// Clears rest of original extent and updates directory record, patched data must be already written
+static void finishIsoFilePatch(Stream& iso, const IsoDirectoryRecordEntry& record, u64 length) {
+    if (record.length > length) {
+        iso.seek(static_cast<i64>(record.lba) * ISO_SECTOR_SIZE + length);
+        iso.writeZeros(record.length - length);
+    }
+    iso.seek(record.isoOffset + 2 + 8);
+    iso.writeInt(length);
+    iso.writeIntB(length);
+}
+
 void patchIsoFile(Stream& iso, const std::vector<IsoDirectoryRecord>& records, const std::string relPath,
-                  const ByteBuffer& patch) {
-    spdlog::trace("Patch ISO file: '{}'", relPath);
+                  const ByteBuffer& patch, const IsoPatchOptions& options) {
+    std::string operation = "patch:" + relPath;
+    PatchJournal* journal = options.journal;
     auto record = seekToIsoFile(iso, records, relPath);
-    ByteBuffer source(record.length);
-    iso.readFully(source);
-    ByteBuffer patched = applyPatch(source, patch);
-    if (patched.size() / ISO_SECTOR_SIZE > source.size() / ISO_SECTOR_SIZE) {
+    std::optional<PatchJournalOutput> intent;
+    if (journal != nullptr) {
+        if (auto completed = journal->getCompleted(operation)) {
+            if (!isIsoRecordOutput(iso, record.isoOffset, *completed)) {
+                spdlog::error("ISO file '{}' doesn't match output recorded by previous run", relPath);
+                bail("ISO image was modified after patching was interrupted, start again with original image");
+            }
+            spdlog::trace("Skip ISO file patched by previous run: '{}'", relPath);
+            return;
+        }
+        intent = journal->getIntent(operation);
+    }
+    spdlog::trace("Patch ISO file: '{}'", relPath);
+    TIMELINE_SCOPE("patchIsoFile");
+    if (intent && intent->length <= record.length && hashIsoExtent(iso, record.lba, intent->length) == intent->hash) {
+        spdlog::trace("Previous run wrote whole output, finishing directory record update");
+        finishIsoFilePatch(iso, record, intent->length);
+        iso.flush();
+        journal->markCompleted(operation, *intent);
+        return;
+    }
+    // bytes outside of segments read from source are never accessed by xdelta so they can stay uninitialized
+    PooledBuffer source(record.length);
+    auto ranges = readPatchSourceSegments(iso, record, patch, source);
+    PooledBuffer patched;
+    XXH128_hash_t sourceKey = {};
+    bool cached = false;
+    if (options.cache != nullptr || journal != nullptr) {
+        sourceKey = getPatchCacheKey(source, ranges, patch);
+    }
+    if (intent && !isSameKey(sourceKey, intent->sourceKey)) {
+        // previous run already overwrote part of the source, only cached output can be used
+        sourceKey = intent->sourceKey;
+        cached = options.cache != nullptr && options.cache->load(sourceKey, patched) &&
+                 XXH3_64bits(patched.data(), patched.size()) == intent->hash;
+        if (!cached) {
+            spdlog::error("ISO file '{}' was partially overwritten by interrupted run", relPath);
+            bail("Interrupted patching can't be resumed, start again with original image");
+        }
+    } else if (options.cache != nullptr) {
+        cached = options.cache->load(sourceKey, patched);
+    }
+    // size is checked before the buffer is allocated, corrupt window headers can declare any size
+    u64 patchedSize = cached ? patched.size() : getVcdiffTargetSize(patch.data(), patch.size());
+    if (patchedSize / ISO_SECTOR_SIZE > source.size() / ISO_SECTOR_SIZE) {
         spdlog::error("ISO file '{}' won't fit in original place after patching", relPath);
         bail("Failed to patch ISO file in-place");
     }
-    iso.seek(record.lba * ISO_SECTOR_SIZE);
-    iso.writeFully(patched);
-    u32 sizeDiff = source.size() - patched.size();
-    if (sizeDiff > 0) {
-        ByteBuffer blank(sizeDiff);
-        iso.writeFully(blank);
+    if (!cached) {
+        patched.resize(patchedSize);
+    }
+    if (!cached && !patched.empty()) {
+        patched.resize(applyPatch(source.data(), source.size(), patch.data(), patch.size(), patched.data(),
+                                  patched.size()));
+    }
+    verifyOutputHash(relPath, patched.data(), patched.size(), options.expectedHash);
+    if (options.cache != nullptr && !cached) {
+        options.cache->store(sourceKey, patched.data(), patched.size());
+    }
+    PatchJournalOutput output;
+    if (journal != nullptr) {
+        output.hash = XXH3_64bits(patched.data(), patched.size());
+        output.length = patched.size();
+        output.sourceKey = sourceKey;
+        journal->markIntent(operation, output);
+    }
+    iso.seek(static_cast<i64>(record.lba) * ISO_SECTOR_SIZE);
+    iso.writeFully(patched.data(), patched.size());
+    finishIsoFilePatch(iso, record, patched.size());
+    if (journal != nullptr) {
+        // data has to reach the image before it's recorded as done
+        iso.flush();
+        journal->markCompleted(operation, output);
     }
-    iso.seek(record.isoOffset + 2 + 8);
-    iso.writeInt(patched.size());
-    iso.writeIntB(patched.size());
 }
 
 void relocateIsoFile(Stream& srcIso, Stream& destIso, const std::vector<IsoDirectoryRecord>& records,
-                     const std::string relPath) {
-    spdlog::trace("Relocate ISO file: '{}'", relPath);
+                     const std::string relPath, PatchJournal* journal) {
+    std::string operation = "relocate:" + relPath;
     auto srcRecord = seekToIsoFile(srcIso, records, relPath);
-    ByteBuffer source(srcRecord.length);
-    srcIso.readFully(source);
+    if (journal != nullptr) {
+        // source image is not modified so relocation that doesn't match its record can be simply done again
+        auto completed = journal->getCompleted(operation);
+        if (completed && isIsoRecordOutput(destIso, srcRecord.isoOffset, *completed)) {
+            spdlog::trace("Skip ISO file relocated by previous run: '{}'", relPath);
+            return;
+        } else if (completed) {
+            spdlog::warn("ISO file '{}' doesn't match output recorded by previous run, relocating it again", relPath);
+        }
+        srcIso.seek(static_cast<i64>(srcRecord.lba) * ISO_SECTOR_SIZE);
+    }
+    spdlog::trace("Relocate ISO file: '{}'", relPath);
+    TIMELINE_SCOPE("relocateIsoFile");
+    PooledBuffer source(srcRecord.length);
+    srcIso.readFully(source.data(), source.size());
     destIso.seek(destIso.length());
     destIso.align(ISO_SECTOR_SIZE);
     i32 destLba = destIso.pos() / ISO_SECTOR_SIZE;
-    destIso.writeFully(source);
+    destIso.writeFully(source.data(), source.size());
     destIso.align(ISO_SECTOR_SIZE);
     destIso.seek(srcRecord.isoOffset + 2);
     destIso.writeInt(destLba);
@@ -83,4 +259,11 @@ void relocateIsoFile(Stream& srcIso, Stream& destIso, const std::vector<IsoDirec
     destIso.seek(srcRecord.isoOffset + 2 + 8);
     destIso.writeInt(source.size());
     destIso.writeIntB(source.size());
+    if (journal != nullptr) {
+        destIso.flush();
+        PatchJournalOutput output;
+        output.hash = XXH3_64bits(source.data(), source.size());
+        output.length = source.size();
+        journal->markCompleted(operation, output);
+    }
 }
@@ -1,16 +1,36 @@
 #pragma once
 
+#include <optional>
+
 #include "iso9660.h"
+#include "journal.h"
+#include "patchcache.h"
 #include "platform.h"
 
-ByteBuffer stashIsoPrimaryDescriptor(Stream& iso);
-void restoreIsoPrimaryDescriptor(Stream& iso, ByteBuffer descriptor);
+class IsoPatchOptions {
+  public:
+    // XXH3 64 bit hash of patched file, on mismatch nothing is written and the image is left without restored primary
+    // descriptor
+    std::optional<u64> expectedHash;
+    // when set, patched files are reused from and stored to the cache
+    PatchCache* cache = nullptr;
+    // when set, files already patched by interrupted run are verified and skipped, files interrupted while being
+    // written are finished or restored from the cache
+    PatchJournal* journal = nullptr;
+};
+
+// With journal, descriptor is recorded before it's removed from the image and resumed runs reuse recorded one
+ByteBuffer stashIsoPrimaryDescriptor(Stream& iso, PatchJournal* journal = nullptr);
+// Journal is removed once descriptor is restored
+void restoreIsoPrimaryDescriptor(Stream& iso, ByteBuffer descriptor, PatchJournal* journal = nullptr);
+// Puts descriptor recorded in journal back so image of interrupted run can be read again, does nothing for new runs
+void recoverIsoPrimaryDescriptor(Stream& iso, PatchJournal& journal);
 
 std::vector<IsoDirectoryRecord> getIsoRecords(const fs::path& isoPath);
 IsoDirectoryRecordEntry seekToIsoFile(Stream& iso, const std::vector<IsoDirectoryRecord>& records,
                                       const std::string relPath);
 
 void patchIsoFile(Stream& iso, const std::vector<IsoDirectoryRecord>& records, const std::string relPath,
-                  const ByteBuffer& patch);
+                  const ByteBuffer& patch, const IsoPatchOptions& options = IsoPatchOptions());
 void relocateIsoFile(Stream& srcIso, Stream& destIso, const std::vector<IsoDirectoryRecord>& records,
-                     const std::string relPath);
+                     const std::string relPath, PatchJournal* journal = nullptr);
@@ -0,0 +1,157 @@
+#include "journal.h"
+
+#include "spdlog/spdlog.h"
+#include "xxhash.h"
+
+#include "fine.h"
+
+// Header: magic, u32 version, u64 job id. Record: u32 payload length, payload, u32 checksum of payload.
+// Payload: u8 type, u64 output hash, u64 output length, u64 source key low, u64 source key high, u32 data length, data.
+static const char JOURNAL_MAGIC[] = "FJRN";
+static const u32 JOURNAL_VERSION = 2;
+static const i64 JOURNAL_HEADER_SIZE = 16;
+static const usize JOURNAL_PAYLOAD_HEADER_SIZE = 37;
+static const u8 JOURNAL_DESCRIPTOR = 1;
+static const u8 JOURNAL_COMPLETED = 2;
+static const u8 JOURNAL_INTENT = 3;
+
+static u32 getChecksum(const u8* data, usize length) {
+    return static_cast<u32>(XXH3_64bits(data, length));
+}
+
+PatchJournal::PatchJournal(const fs::path& path, u64 jobId) : path(path), jobId(jobId) {
+    i64 validLength = fs::exists(path) ? load() : 0;
+    if (validLength == 0) {
+        createEmptyFile(path);
+    } else {
+        // drop record that was being written when previous run stopped
+        fs::resize_file(path, validLength);
+    }
+    stream = std::make_unique<Stream>(path);
+    if (!stream->good()) {
+        bail("Failed to open patch journal");
+    }
+    if (validLength == 0) {
+        stream->writeString(JOURNAL_MAGIC);
+        stream->writeInt(JOURNAL_VERSION);
+        stream->writeLong(jobId);
+        stream->flush();
+    } else {
+        stream->seek(validLength);
+    }
+}
+
+i64 PatchJournal::load() {
+    ByteBuffer data = readFile(path);
+    if (data.size() < JOURNAL_HEADER_SIZE) {
+        spdlog::warn("Patch journal '{}' is invalid, starting over", path.u8string());
+        return 0;
+    }
+    Stream input(data);
+    if (input.readString(4) != JOURNAL_MAGIC || static_cast<u32>(input.readInt()) != JOURNAL_VERSION) {
+        spdlog::warn("Patch journal '{}' is invalid, starting over", path.u8string());
+        return 0;
+    }
+    if (static_cast<u64>(input.readLong()) != jobId) {
+        spdlog::info("Patch journal '{}' belongs to different inputs, starting over", path.u8string());
+        return 0;
+    }
+    usize pos = JOURNAL_HEADER_SIZE;
+    while (pos + 4 <= data.size()) {
+        input.seek(pos);
+        u32 payloadLength = input.readInt();
+        if (payloadLength < JOURNAL_PAYLOAD_HEADER_SIZE || pos + 4 + payloadLength + 4 > data.size()) break;
+        const u8* payload = data.data() + pos + 4;
+        input.seek(pos + 4 + payloadLength);
+        if (getChecksum(payload, payloadLength) != static_cast<u32>(input.readInt())) break;
+        input.seek(pos + 4);
+        u8 type = input.readByte();
+        PatchJournalOutput output;
+        output.hash = input.readLong();
+        output.length = input.readLong();
+        output.sourceKey.low64 = input.readLong();
+        output.sourceKey.high64 = input.readLong();
+        u32 dataLength = input.readInt();
+        if (JOURNAL_PAYLOAD_HEADER_SIZE + dataLength != payloadLength) break;
+        const u8* recordData = payload + JOURNAL_PAYLOAD_HEADER_SIZE;
+        if (type == JOURNAL_DESCRIPTOR) {
+            descriptor = ByteBuffer(recordData, recordData + dataLength);
+        } else if (type == JOURNAL_COMPLETED) {
+            completed[std::string(recordData, recordData + dataLength)] = output;
+        } else if (type == JOURNAL_INTENT) {
+            intents[std::string(recordData, recordData + dataLength)] = output;
+        }
+        pos += 4 + payloadLength + 4;
+    }
+    if (pos != data.size()) {
+        spdlog::warn("Patch journal '{}' has damaged tail, it will be dropped", path.u8string());
+    }
+    spdlog::info("Resuming from patch journal, {} operations already completed", completed.size());
+    return pos;
+}
+
+std::optional<PatchJournalOutput> PatchJournal::getCompleted(const std::string& operation) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = completed.find(operation);
+    if (it == completed.end()) return std::nullopt;
+    return it->second;
+}
+
+std::optional<PatchJournalOutput> PatchJournal::getIntent(const std::string& operation) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = intents.find(operation);
+    if (it == intents.end()) return std::nullopt;
+    return it->second;
+}
+
+void PatchJournal::markIntent(const std::string& operation, const PatchJournalOutput& output) {
+    std::lock_guard<std::mutex> lock(mutex);
+    append(JOURNAL_INTENT, output, reinterpret_cast<const u8*>(operation.data()), operation.size());
+    intents[operation] = output;
+}
+
+void PatchJournal::markCompleted(const std::string& operation, const PatchJournalOutput& output) {
+    std::lock_guard<std::mutex> lock(mutex);
+    append(JOURNAL_COMPLETED, output, reinterpret_cast<const u8*>(operation.data()), operation.size());
+    completed[operation] = output;
+}
+
+std::optional<ByteBuffer> PatchJournal::getDescriptor() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return descriptor;
+}
+
+void PatchJournal::setDescriptor(const ByteBuffer& newDescriptor) {
+    std::lock_guard<std::mutex> lock(mutex);
+    append(JOURNAL_DESCRIPTOR, PatchJournalOutput(), newDescriptor.data(), newDescriptor.size());
+    descriptor = newDescriptor;
+}
+
+void PatchJournal::append(u8 type, const PatchJournalOutput& output, const u8* data, u32 length) {
+    ByteBuffer payload(JOURNAL_PAYLOAD_HEADER_SIZE + length);
+    Stream payloadStream(payload);
+    payloadStream.writeByte(type);
+    payloadStream.writeLong(output.hash);
+    payloadStream.writeLong(output.length);
+    payloadStream.writeLong(output.sourceKey.low64);
+    payloadStream.writeLong(output.sourceKey.high64);
+    payloadStream.writeInt(length);
+    payloadStream.writeFully(data, length);
+    stream->writeInt(payload.size());
+    stream->writeFully(payload);
+    stream->writeInt(getChecksum(payload.data(), payload.size()));
+    stream->flush();
+    if (!stream->good()) {
+        bail("Failed to write patch journal");
+    }
+}
+
+void PatchJournal::finish() {
+    std::lock_guard<std::mutex> lock(mutex);
+    stream.reset();
+    std::error_code error;
+    fs::remove(path, error);
+    intents.clear();
+    completed.clear();
+    descriptor.reset();
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include "platform.h"
+
+#include <mutex>
+#include <optional>
+
+#include "xxhash.h"
+
+#include "stream.h"
+
+// Output of patching operation as recorded in journal
+class PatchJournalOutput {
+  public:
+    // XXH3 64 bit hash of output
+    u64 hash = 0;
+    u64 length = 0;
+    // hash of inputs the output was created from, used to tell whether inputs were already overwritten
+    XXH128_hash_t sourceKey = {};
+};
+
+// Append only journal of patching operations. Intent is recorded before operation starts overwriting its inputs and
+// completion once its output reached the image, so a resumed run can tell which outputs are only partially written.
+// Records are checksummed, journal is read up to the first damaged record so a write cut short by a crash only loses
+// that record. Job id identifies patched inputs, journal left by different job is discarded.
+class PatchJournal {
+  public:
+    PatchJournal(const fs::path& path, u64 jobId);
+    std::optional<PatchJournalOutput> getCompleted(const std::string& operation);
+    std::optional<PatchJournalOutput> getIntent(const std::string& operation);
+    void markIntent(const std::string& operation, const PatchJournalOutput& output);
+    void markCompleted(const std::string& operation, const PatchJournalOutput& output);
+    // Original primary descriptor stashed by this job, it has to survive restarts because the image no longer has it
+    std::optional<ByteBuffer> getDescriptor();
+    void setDescriptor(const ByteBuffer& descriptor);
+    // Removes journal once all work is done
+    void finish();
+
+  private:
+    i64 load();
+    void append(u8 type, const PatchJournalOutput& output, const u8* data, u32 length);
+    const fs::path path;
+    const u64 jobId;
+    std::unique_ptr<Stream> stream;
+    std::map<std::string, PatchJournalOutput> intents;
+    std::map<std::string, PatchJournalOutput> completed;
+    std::optional<ByteBuffer> descriptor;
+    std::mutex mutex;
+};
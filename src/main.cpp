@@ -1,6 +1,9 @@
 #include "fine.h"
+#include "iostats.h"
+#include "patchbuild.h"
 #include "patchfs.h"
 #include "platform.h"
+#include "timeline.h"
 
 #include "spdlog/sinks/basic_file_sink.h"
 #include "spdlog/sinks/stdout_color_sinks.h"
@@ -31,6 +34,69 @@ static void createPatch(const std::vector<std::string>& args) {
     createPatch(sourcePath, targetPath, patchPath);
 }
 
+static std::string getOptionValue(const std::vector<std::string>& args, const std::string& name,
+                                  const std::string& defaultValue) {
+    auto option = std::find(args.begin(), args.end(), name);
+    if (option == args.end()) return defaultValue;
+    if (option + 1 == args.end()) {
+        bail("Missing value for option " + name);
+    }
+    return *(option + 1);
+}
+
+static u32 getNumericOptionValue(const std::vector<std::string>& args, const std::string& name, u32 defaultValue) {
+    std::string value = getOptionValue(args, name, std::to_string(defaultValue));
+    try {
+        return std::stoul(value);
+    } catch (const std::logic_error&) {
+        bail("Invalid value for option " + name + ": " + value);
+        __builtin_unreachable();
+    }
+}
+
+static PatchBuildSettings getBuildSettings(const std::vector<std::string>& args) {
+    PatchBuildSettings settings;
+    settings.threads = getNumericOptionValue(args, "--threads", settings.threads);
+    settings.xdelta.windowSize = getNumericOptionValue(args, "--window", settings.xdelta.windowSize);
+    settings.xdelta.level = getNumericOptionValue(args, "--level", settings.xdelta.level);
+    settings.compress = std::find(args.begin(), args.end(), "--no-compress") == args.end();
+    std::string secondary = getOptionValue(args, "--secondary", "none");
+    if (secondary == "djw") {
+        settings.xdelta.secondary = XdeltaSecondary::Djw;
+    } else if (secondary == "fgk") {
+        settings.xdelta.secondary = XdeltaSecondary::Fgk;
+    } else if (secondary != "none") {
+        bail("Invalid secondary compression, expected one of: none, djw, fgk");
+    }
+    return settings;
+}
+
+static void buildPatchFs(const std::vector<std::string>& args) {
+    auto originalPath = fs::u8path(args[1]);
+    auto modifiedPath = fs::u8path(args[2]);
+    auto outputPath = fs::u8path(args[3]);
+    if (!fs::is_directory(originalPath)) {
+        bail("Original directory does not exist");
+    }
+    if (!fs::is_directory(modifiedPath)) {
+        bail("Modified directory does not exist");
+    }
+    buildPatchFs(originalPath, modifiedPath, outputPath, getBuildSettings(args));
+}
+
+static void buildIsoPatchFs(const std::vector<std::string>& args) {
+    auto originalPath = fs::u8path(args[1]);
+    auto modifiedPath = fs::u8path(args[2]);
+    auto outputPath = fs::u8path(args[3]);
+    if (!fs::exists(originalPath)) {
+        bail("Original ISO does not exist");
+    }
+    if (!fs::exists(modifiedPath)) {
+        bail("Modified ISO does not exist");
+    }
+    buildIsoPatchFs(originalPath, modifiedPath, outputPath, getBuildSettings(args));
+}
+
 static void applyPatchFs(const std::vector<std::string>& args) {
     auto patchFsPath = fs::u8path(args[0]);
     auto inputPath = fs::u8path(args[1]);
@@ -38,6 +104,9 @@ static void applyPatchFs(const std::vector<std::string>& args) {
     if (std::find(args.begin(), args.end(), "--trace") != args.end()) {
         spdlog::default_logger()->set_level(spdlog::level::trace);
     }
+    if (std::find(args.begin(), args.end(), "--timeline") != args.end()) {
+        Timeline::enable("patcher-timeline.json");
+    }
 
     if (!fs::exists(patchFsPath)) {
         bail("PatchFS does not exist");
@@ -48,14 +117,19 @@ static void applyPatchFs(const std::vector<std::string>& args) {
     // output not checked, it's job of the module because it depends on what module needs.
 
     spdlog::info("Open PatchFS: '{}'", args[0]);
-    PatchFsFile patchFs(patchFsPath);
+    PatchFsFile patchFs(patchFsPath, true);
     if (patchFs.getFilesCount() == 0) {
         bail("PatchFS is empty or failed to open");
     } else {
         spdlog::debug("Opened PatchFS containing {} files", patchFs.getFilesCount());
     }
+    // entries are checked when they are read, full verification reads the whole PatchFS
+    if (std::find(args.begin(), args.end(), "--verify") != args.end() && !patchFs.verify()) {
+        bail("PatchFS is corrupted, please download it again");
+    }
     auto extraArgs = std::vector(args.begin() + 3, args.end());
     moduleBootup(patchFs, inputPath, outputPath, extraArgs);
+    IoStats::dump();
     spdlog::info("Patching completed");
 }
 
@@ -69,14 +143,21 @@ static void fineBootup(const std::vector<std::string>& args) {
             spdlog::debug("Argument: '{}'", arg);
         }
         if (args.size() < 3) {
-            bail("Invalid number of arguments. Please specify arguments: [patchFs] [input] [output] <--trace>");
+            bail("Invalid number of arguments. Please specify arguments: [patchFs] [input] [output] <--trace> "
+                 "<--timeline> <--verify>");
         }
         if (args[0] == "-encode" && args.size() == 4) {
             createPatch(args);
+        } else if (args[0] == "-build" && args.size() >= 4) {
+            buildPatchFs(args);
+        } else if (args[0] == "-diff-iso" && args.size() >= 4) {
+            buildIsoPatchFs(args);
         } else {
             applyPatchFs(args);
         }
+        Timeline::finish();
     } catch (const std::runtime_error& e) {
+        Timeline::finish();
         spdlog::critical("A critical error has occurred, the process will exit");
         auto msg = e.what();
         if (strlen(msg) > 0) {
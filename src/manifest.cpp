@@ -0,0 +1,107 @@
+#include "manifest.h"
+
+#include <iomanip>
+
+#include "picojson.h"
+#include "spdlog/spdlog.h"
+
+static const i64 MANIFEST_VERSION = 1;
+
+static std::string entryTypeName(PatchEntryType type) {
+    switch (type) {
+    case PatchEntryType::Xdelta:
+        return "xdelta";
+    case PatchEntryType::Raw:
+        return "raw";
+    }
+    __builtin_unreachable();
+}
+
+static PatchEntryType parseEntryType(const std::string& name) {
+    if (name == "xdelta") return PatchEntryType::Xdelta;
+    if (name == "raw") return PatchEntryType::Raw;
+    spdlog::error("Unknown manifest entry type: '{}'", name);
+    bail("Invalid patch manifest");
+    __builtin_unreachable();
+}
+
+static std::string formatHash(u64 hash) {
+    std::ostringstream ss;
+    ss << std::hex << std::setfill('0') << std::setw(16) << hash;
+    return ss.str();
+}
+
+static u64 parseHash(const std::string& hex) {
+    if (hex.empty() || hex.size() > 16 || hex.find_first_not_of("0123456789abcdefABCDEF") != std::string::npos) {
+        spdlog::error("Invalid manifest hash: '{}'", hex);
+        bail("Invalid patch manifest entry");
+    }
+    return std::stoull(hex, nullptr, 16);
+}
+
+PatchManifest::PatchManifest() {
+}
+
+PatchManifest::PatchManifest(const ByteBuffer& json) {
+    picojson::value root;
+    std::string error = picojson::parse(root, std::string(json.begin(), json.end()));
+    if (!error.empty()) {
+        spdlog::error("Failed to parse patch manifest: {}", error);
+        bail("Invalid patch manifest");
+    }
+    if (!root.is<picojson::object>() || !root.get("files").is<picojson::array>()) {
+        bail("Invalid patch manifest");
+    }
+    for (const auto& file : root.get("files").get<picojson::array>()) {
+        if (!file.get("path").is<std::string>() || !file.get("type").is<std::string>() ||
+            !file.get("size").is<i64>()) {
+            bail("Invalid patch manifest entry");
+        }
+        std::optional<u64> hash;
+        if (file.get("xxh3").is<std::string>()) {
+            hash = parseHash(file.get("xxh3").get<std::string>());
+        }
+        entries.emplace_back(file.get("path").get<std::string>(), parseEntryType(file.get("type").get<std::string>()),
+                             file.get("size").get<i64>(), hash);
+    }
+    spdlog::debug("Loaded patch manifest with {} entries", entries.size());
+}
+
+void PatchManifest::add(const PatchManifestEntry& entry) {
+    entries.push_back(entry);
+}
+
+const PatchManifestEntry* PatchManifest::find(const std::string& path) const {
+    for (const auto& entry : entries) {
+        if (entry.path == path) return &entry;
+    }
+    return nullptr;
+}
+
+const std::vector<PatchManifestEntry>& PatchManifest::getEntries() const {
+    return entries;
+}
+
+std::string PatchManifest::serialize() const {
+    std::vector<const PatchManifestEntry*> sorted;
+    for (const auto& entry : entries) {
+        sorted.push_back(&entry);
+    }
+    std::sort(sorted.begin(), sorted.end(), [](const auto* a, const auto* b) { return a->path < b->path; });
+    picojson::array files;
+    for (const auto* entry : sorted) {
+        picojson::object file;
+        file["path"] = picojson::value(entry->path);
+        file["type"] = picojson::value(entryTypeName(entry->type));
+        file["size"] = picojson::value(static_cast<i64>(entry->size));
+        // stored as string, JSON numbers can't hold all 64 bit values
+        if (entry->hash) {
+            file["xxh3"] = picojson::value(formatHash(*entry->hash));
+        }
+        files.emplace_back(file);
+    }
+    picojson::object root;
+    root["version"] = picojson::value(MANIFEST_VERSION);
+    root["files"] = picojson::value(files);
+    return picojson::value(root).serialize(true);
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include "platform.h"
+
+#include <optional>
+
+// Name of PatchFS entry describing how other entries should be applied
+const std::string PATCHFS_MANIFEST_NAME = "manifest.json";
+
+enum class PatchEntryType { Xdelta, Raw };
+
+class PatchManifestEntry {
+  public:
+    PatchManifestEntry(const std::string& path, PatchEntryType type, u64 size, std::optional<u64> hash = std::nullopt)
+        : path(path), type(type), size(size), hash(hash) {
+    }
+    std::string path;
+    PatchEntryType type;
+    u64 size;
+    // XXH3 64 bit hash of the output file, not present in older manifests
+    std::optional<u64> hash;
+};
+
+class PatchManifest {
+  public:
+    PatchManifest();
+    PatchManifest(const ByteBuffer& json);
+    void add(const PatchManifestEntry& entry);
+    const PatchManifestEntry* find(const std::string& path) const;
+    const std::vector<PatchManifestEntry>& getEntries() const;
+    std::string serialize() const;
+
+  private:
+    std::vector<PatchManifestEntry> entries;
+};
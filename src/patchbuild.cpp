@@ -0,0 +1,302 @@
+#include "patchbuild.h"
+
+#include <atomic>
+#include <numeric>
+
+#include "spdlog/spdlog.h"
+#include "xxhash.h"
+
+#include "bufferpool.h"
+#include "iso9660.h"
+#include "manifest.h"
+#include "patchfs.h"
+#include "taskpool.h"
+
+// Size of reads used to hash ISO files
+static const usize ISO_HASH_CHUNK_SIZE = 4 * 1024 * 1024;
+// Changed ISO files are read in batches of about this many bytes of both images
+static const u64 ISO_READ_BATCH_SIZE = 256 * 1024 * 1024;
+
+// Collects entries produced by worker threads into PatchFS and its manifest
+class PatchFsBuildOutput {
+  public:
+    PatchFsBuildOutput(const fs::path& output, u32 maxEntries, const PatchBuildSettings& settings)
+        : writer(output, maxEntries + 1), settings(settings.xdelta), compress(settings.compress) {
+    }
+
+    void addChanged(const std::string& relPath, const u8* source, usize sourceLen, const u8* target,
+                    usize targetLen) {
+        ByteBuffer patch = createPatch(source, sourceLen, target, targetLen, settings);
+        PatchManifestEntry entry(relPath, PatchEntryType::Xdelta, targetLen, XXH3_64bits(target, targetLen));
+        // store as is when delta doesn't save anything
+        if (patch.size() >= targetLen) {
+            entry.type = PatchEntryType::Raw;
+            add(entry, target, targetLen);
+        } else {
+            add(entry, patch.data(), patch.size());
+        }
+    }
+
+    void addNew(const std::string& relPath, const u8* target, usize targetLen) {
+        add(PatchManifestEntry(relPath, PatchEntryType::Raw, targetLen, XXH3_64bits(target, targetLen)), target,
+            targetLen);
+    }
+
+    void finish() {
+        std::string manifestJson = manifest.serialize();
+        writer.add(PATCHFS_MANIFEST_NAME, reinterpret_cast<const u8*>(manifestJson.data()), manifestJson.size());
+        writer.finish();
+    }
+
+    usize getEntriesCount() const {
+        return manifest.getEntries().size();
+    }
+
+  private:
+    void add(const PatchManifestEntry& entry, const u8* data, usize length) {
+        const std::string& relPath = entry.path;
+        spdlog::debug("Built {} entry for '{}', size: {}", entry.type == PatchEntryType::Raw ? "raw" : "xdelta",
+                      relPath, length);
+        // deltas are already compressed by xdelta, raw entries are compressed before taking the lock
+        ByteBuffer compressed;
+        PatchFsCompression compression = PatchFsCompression::None;
+        if (compress && entry.type == PatchEntryType::Raw) {
+            compression = compressPatchFsPayload(data, length, compressed);
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        if (compression == PatchFsCompression::None) {
+            writer.add(relPath, data, length);
+        } else {
+            writer.addCompressed(relPath, compression, compressed, length);
+        }
+        manifest.add(entry);
+    }
+
+    PatchFsWriter writer;
+    PatchManifest manifest;
+    const XdeltaSettings settings;
+    const bool compress;
+    std::mutex mutex;
+};
+
+static std::vector<std::string> listFiles(const fs::path& dir) {
+    std::vector<std::string> files;
+    for (const auto& entry : fs::recursive_directory_iterator(dir)) {
+        if (entry.is_regular_file()) {
+            files.push_back(fs::relative(entry.path(), dir).generic_u8string());
+        }
+    }
+    std::sort(files.begin(), files.end());
+    return files;
+}
+
+void buildPatchFs(const fs::path& original, const fs::path& modified, const fs::path& output,
+                  const PatchBuildSettings& settings) {
+    spdlog::info("Build PatchFS '{}' from '{}' -> '{}'", output.u8string(), original.u8string(), modified.u8string());
+    std::vector<std::string> files = listFiles(modified);
+    spdlog::info("Found {} files in modified directory", files.size());
+
+    PatchFsBuildOutput buildOutput(output, files.size(), settings);
+    std::atomic<u32> skipped(0);
+    TaskPool pool(settings.threads);
+    for (const auto& relPath : files) {
+        pool.submit([&, relPath] {
+            fs::path originalPath = original / fs::u8path(relPath);
+            FileView target = readFileView(modified / fs::u8path(relPath));
+            if (!fs::exists(originalPath)) {
+                buildOutput.addNew(relPath, target.data(), target.size());
+                return;
+            }
+            FileView source = readFileView(originalPath);
+            if (source.size() == target.size() &&
+                (source.size() == 0 || std::memcmp(source.data(), target.data(), source.size()) == 0)) {
+                skipped++;
+                return;
+            }
+            buildOutput.addChanged(relPath, source.data(), source.size(), target.data(), target.size());
+        });
+    }
+    pool.wait();
+    buildOutput.finish();
+    spdlog::info("PatchFS built: {} changed files, {} unchanged", buildOutput.getEntriesCount(), skipped.load());
+}
+
+// Directory records of ISO file, multi-extent files have a record for each extent
+using IsoFileExtents = std::vector<const IsoDirectoryRecordEntry*>;
+
+static std::map<std::string, IsoFileExtents> getIsoFiles(Iso9660Reader& reader) {
+    std::map<std::string, IsoFileExtents> files;
+    for (const auto& record : reader.getRecords()) {
+        for (const auto& entry : record.getEntries()) {
+            if ((entry.atributes & ISO_ATTRIBUTE_DIRECTORY) == 0) {
+                files[entry.relPath].push_back(&entry);
+            }
+        }
+    }
+    return files;
+}
+
+static u64 getIsoFileLength(const IsoFileExtents& extents) {
+    u64 length = 0;
+    for (const auto* extent : extents) {
+        length += extent->length;
+    }
+    return length;
+}
+
+static ByteBuffer readIsoFile(Stream& iso, const IsoFileExtents& extents) {
+    ByteBuffer data(getIsoFileLength(extents));
+    u8* output = data.data();
+    for (const auto* extent : extents) {
+        iso.seek(static_cast<i64>(extent->lba) * ISO_SECTOR_SIZE);
+        iso.readFully(output, extent->length);
+        output += extent->length;
+    }
+    if (!iso.good()) {
+        spdlog::error("Failed to read ISO file: '{}'", extents.front()->relPath);
+        bail("Failed to read ISO");
+    }
+    return data;
+}
+
+static bool isSameHash(const XXH128_hash_t& a, const XXH128_hash_t& b) {
+    return a.low64 == b.low64 && a.high64 == b.high64;
+}
+
+// Hashes extents of given files, image is read once in LBA order in chunks of limited size. Hashes are stored in the
+// order of file extents.
+static std::map<std::string, std::vector<XXH128_hash_t>> hashIsoFiles(
+    Stream& iso, const std::map<std::string, IsoFileExtents>& files, const std::vector<std::string>& names) {
+    std::map<std::string, std::vector<XXH128_hash_t>> hashes;
+    std::vector<std::pair<const IsoDirectoryRecordEntry*, XXH128_hash_t*>> sorted;
+    for (const auto& name : names) {
+        const IsoFileExtents& extents = files.at(name);
+        std::vector<XXH128_hash_t>& fileHashes = hashes[name];
+        fileHashes.resize(extents.size());
+        for (usize i = 0; i < extents.size(); i++) {
+            sorted.emplace_back(extents[i], &fileHashes[i]);
+        }
+    }
+    std::sort(sorted.begin(), sorted.end(), [](const auto& a, const auto& b) { return a.first->lba < b.first->lba; });
+    PooledBuffer chunk(ISO_HASH_CHUNK_SIZE);
+    XXH3_state_t* state = XXH3_createState();
+    for (const auto& extent : sorted) {
+        const IsoDirectoryRecordEntry* entry = extent.first;
+        XXH3_128bits_reset(state);
+        iso.seek(static_cast<i64>(entry->lba) * ISO_SECTOR_SIZE);
+        for (u64 remaining = entry->length; remaining > 0;) {
+            usize length = std::min<u64>(remaining, chunk.size());
+            iso.readFully(chunk.data(), length);
+            XXH3_128bits_update(state, chunk.data(), length);
+            remaining -= length;
+        }
+        if (!iso.good()) {
+            XXH3_freeState(state);
+            spdlog::error("Failed to read ISO file: '{}'", entry->relPath);
+            bail("Failed to read ISO");
+        }
+        *extent.second = XXH3_128bits_digest(state);
+    }
+    XXH3_freeState(state);
+    return hashes;
+}
+
+void buildIsoPatchFs(const fs::path& original, const fs::path& modified, const fs::path& output,
+                     const PatchBuildSettings& settings) {
+    spdlog::info("Build PatchFS '{}' from ISO '{}' -> '{}'", output.u8string(), original.u8string(),
+                 modified.u8string());
+    Iso9660Reader originalReader(original);
+    Iso9660Reader modifiedReader(modified);
+    auto originalFiles = getIsoFiles(originalReader);
+    auto modifiedFiles = getIsoFiles(modifiedReader);
+    Stream originalIso(original, true);
+    Stream modifiedIso(modified, true);
+    if (!originalIso.good() || !modifiedIso.good()) {
+        bail("Failed to open ISO");
+    }
+
+    // files with different length are changed without reading them, others are hashed in one sequential pass over
+    // each image
+    std::vector<const IsoFileExtents*> newFiles;
+    std::vector<std::pair<const IsoFileExtents*, const IsoFileExtents*>> changes;
+    std::vector<std::string> sameLength;
+    for (const auto& file : modifiedFiles) {
+        auto originalFile = originalFiles.find(file.first);
+        if (originalFile == originalFiles.end()) {
+            newFiles.push_back(&file.second);
+        } else if (getIsoFileLength(originalFile->second) != getIsoFileLength(file.second) ||
+                   originalFile->second.size() != file.second.size()) {
+            changes.emplace_back(&originalFile->second, &file.second);
+        } else {
+            sameLength.push_back(file.first);
+        }
+    }
+    auto originalHashes = hashIsoFiles(originalIso, originalFiles, sameLength);
+    auto modifiedHashes = hashIsoFiles(modifiedIso, modifiedFiles, sameLength);
+    u32 skipped = 0;
+    for (const auto& name : sameLength) {
+        const auto& originalHash = originalHashes[name];
+        const auto& modifiedHash = modifiedHashes[name];
+        if (std::equal(originalHash.begin(), originalHash.end(), modifiedHash.begin(), isSameHash)) {
+            skipped++;
+        } else {
+            changes.emplace_back(&originalFiles[name], &modifiedFiles[name]);
+        }
+    }
+    for (const auto& change : changes) {
+        // changed files are patched in place, which is done for a single extent only
+        if (change.first->size() > 1 || change.second->size() > 1) {
+            spdlog::error("Changed ISO file '{}' has multiple extents", change.second->front()->relPath);
+            bail("Multi-extent ISO files can't be patched");
+        }
+    }
+    spdlog::info("Found {} changed and {} new files, {} unchanged", changes.size(), newFiles.size(), skipped);
+
+    PatchFsBuildOutput buildOutput(output, modifiedFiles.size(), settings);
+    // bounded queue keeps memory use limited to a few extents per worker
+    TaskPool pool(settings.threads, std::max(2u, settings.threads) * 2);
+    std::sort(newFiles.begin(), newFiles.end(),
+              [](const auto* a, const auto* b) { return a->front()->lba < b->front()->lba; });
+    for (const auto* file : newFiles) {
+        ByteBuffer target = readIsoFile(modifiedIso, *file);
+        pool.submit([&buildOutput, relPath = file->front()->relPath, target = std::move(target)]() {
+            buildOutput.addNew(relPath, target.data(), target.size());
+        });
+    }
+    // changed files are read in batches of limited size, within a batch each image is read in its own LBA order so
+    // that reads only move forward when both images keep files in similar order
+    std::sort(changes.begin(), changes.end(),
+              [](const auto& a, const auto& b) { return a.first->front()->lba < b.first->front()->lba; });
+    for (usize first = 0; first < changes.size();) {
+        usize last = first;
+        u64 batchSize = 0;
+        while (last < changes.size() && (last == first || batchSize <= ISO_READ_BATCH_SIZE)) {
+            batchSize += changes[last].first->front()->length + changes[last].second->front()->length;
+            last++;
+        }
+        std::vector<ByteBuffer> sources;
+        for (usize i = first; i < last; i++) {
+            sources.push_back(readIsoFile(originalIso, *changes[i].first));
+        }
+        std::vector<usize> targetOrder(last - first);
+        std::iota(targetOrder.begin(), targetOrder.end(), 0);
+        std::sort(targetOrder.begin(), targetOrder.end(), [&changes, first](usize a, usize b) {
+            return changes[first + a].second->front()->lba < changes[first + b].second->front()->lba;
+        });
+        std::vector<ByteBuffer> targets(last - first);
+        for (usize i : targetOrder) {
+            targets[i] = readIsoFile(modifiedIso, *changes[first + i].second);
+        }
+        for (usize i = 0; i < last - first; i++) {
+            const std::string& relPath = changes[first + i].second->front()->relPath;
+            auto task = [&buildOutput, relPath, source = std::move(sources[i]), target = std::move(targets[i])]() {
+                buildOutput.addChanged(relPath, source.data(), source.size(), target.data(), target.size());
+            };
+            pool.submit(std::move(task));
+        }
+        first = last;
+    }
+    pool.wait();
+    buildOutput.finish();
+    spdlog::info("PatchFS built: {} changed files, {} unchanged", buildOutput.getEntriesCount(), skipped);
+}
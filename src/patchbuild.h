@@ -0,0 +1,18 @@
+#pragma once
+
+#include "fine.h"
+#include "platform.h"
+
+class PatchBuildSettings {
+  public:
+    XdeltaSettings xdelta;
+    // 0 uses hardware concurrency
+    u32 threads = 0;
+    // compress raw entries when it saves space
+    bool compress = true;
+};
+
+void buildPatchFs(const fs::path& original, const fs::path& modified, const fs::path& output,
+                  const PatchBuildSettings& settings);
+void buildIsoPatchFs(const fs::path& original, const fs::path& modified, const fs::path& output,
+                     const PatchBuildSettings& settings);
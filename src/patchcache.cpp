@@ -0,0 +1,96 @@
+#include "patchcache.h"
+
+#include "spdlog/spdlog.h"
+
+#include "fileio.h"
+#include "fingerprint.h"
+#include "stream.h"
+
+// Entries start with XXH3 64 bit hash of stored data so damaged entries are detected and dropped
+static const usize CACHE_HEADER_SIZE = 8;
+
+PatchCache::PatchCache(const fs::path& dir, u64 maxSize) : dir(dir), maxSize(maxSize), storedSinceTrim(0) {
+    fs::create_directories(dir);
+    spdlog::debug("Patch cache: '{}', limit {} bytes", dir.u8string(), maxSize);
+    trim();
+}
+
+fs::path PatchCache::getEntryPath(const XXH128_hash_t& key) const {
+    std::string name = formatFingerprint(key);
+    // spread entries over subdirectories to keep directories small
+    return dir / name.substr(0, 2) / name;
+}
+
+bool PatchCache::load(const XXH128_hash_t& key, PooledBuffer& output) {
+    fs::path path = getEntryPath(key);
+    ReadOnlyFile file(path);
+    if (!file.good() || file.length() < static_cast<i64>(CACHE_HEADER_SIZE)) return false;
+    u8 header[CACHE_HEADER_SIZE];
+    file.readAt(0, header, CACHE_HEADER_SIZE);
+    output.resize(file.length() - CACHE_HEADER_SIZE);
+    file.readAt(CACHE_HEADER_SIZE, output.data(), output.size());
+    std::error_code error;
+    if (XXH3_64bits(output.data(), output.size()) != static_cast<u64>(Stream(header, CACHE_HEADER_SIZE).readLong())) {
+        spdlog::warn("Patch cache entry '{}' is damaged, removing it", path.u8string());
+        fs::remove(path, error);
+        return false;
+    }
+    // modification time is used as last use time for eviction
+    fs::last_write_time(path, fs::file_time_type::clock::now(), error);
+    spdlog::trace("Patch cache hit: '{}'", path.filename().u8string());
+    return true;
+}
+
+void PatchCache::store(const XXH128_hash_t& key, const u8* data, usize length) {
+    if (length + CACHE_HEADER_SIZE > maxSize) return;
+    fs::path path = getEntryPath(key);
+    std::error_code error;
+    fs::create_directories(path.parent_path(), error);
+    PooledBuffer entry(CACHE_HEADER_SIZE + length);
+    Stream(entry.data(), CACHE_HEADER_SIZE).writeLong(XXH3_64bits(data, length));
+    std::memcpy(entry.data() + CACHE_HEADER_SIZE, data, length);
+    // cache is only an optimization, failing to store entry doesn't fail patching
+    try {
+        writeFileAtomic(path, entry.data(), entry.size());
+    } catch (const std::runtime_error&) {
+        spdlog::warn("Failed to store patch cache entry '{}'", path.u8string());
+        return;
+    }
+    if ((storedSinceTrim += entry.size()) > maxSize / 8) {
+        trim();
+    }
+}
+
+void PatchCache::trim() {
+    storedSinceTrim = 0;
+    struct CachedFile {
+        fs::path path;
+        fs::file_time_type lastUse;
+        u64 size;
+    };
+    std::vector<CachedFile> files;
+    u64 totalSize = 0;
+    std::error_code error;
+    for (auto it = fs::recursive_directory_iterator(dir, error); !error && it != fs::recursive_directory_iterator();
+         it.increment(error)) {
+        // entries have no extension, temporary files of stores in progress are left alone
+        if (!it->is_regular_file(error) || it->path().has_extension()) continue;
+        u64 size = it->file_size(error);
+        auto lastUse = it->last_write_time(error);
+        if (error) continue;
+        files.push_back(CachedFile{it->path(), lastUse, size});
+        totalSize += size;
+    }
+    if (totalSize <= maxSize) return;
+    std::sort(files.begin(), files.end(), [](const auto& a, const auto& b) { return a.lastUse < b.lastUse; });
+    u32 removed = 0;
+    for (const auto& file : files) {
+        if (totalSize <= maxSize) break;
+        // other processes may have removed the file already or still have it open
+        if (fs::remove(file.path, error)) {
+            removed++;
+        }
+        totalSize -= file.size;
+    }
+    spdlog::debug("Patch cache trimmed, removed {} entries", removed);
+}
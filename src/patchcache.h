@@ -0,0 +1,26 @@
+#pragma once
+
+#include "platform.h"
+
+#include <atomic>
+
+#include "xxhash.h"
+
+#include "bufferpool.h"
+
+// On disk cache of patched outputs keyed by hash of patch and the source data it references. Entries are written to
+// temporary files and renamed into place so multiple processes can share one cache directory. Least recently used
+// entries are removed once cache grows over its size limit.
+class PatchCache {
+  public:
+    PatchCache(const fs::path& dir, u64 maxSize);
+    bool load(const XXH128_hash_t& key, PooledBuffer& output);
+    void store(const XXH128_hash_t& key, const u8* data, usize length);
+    void trim();
+
+  private:
+    fs::path getEntryPath(const XXH128_hash_t& key) const;
+    const fs::path dir;
+    const u64 maxSize;
+    std::atomic<u64> storedSinceTrim;
+};
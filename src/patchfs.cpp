@@ -2,83 +2,843 @@
 
 #include "spdlog/spdlog.h"
 
-PatchFsFile::PatchFsFile(const fs::path& path) : stream(path) {
-    if (!stream.good()) return;
-    std::string magic = stream.readString();
-    if (magic != "PATCHFS") return;
-    i32 fileCount = stream.readInt();
-    i32 nestedCount = stream.readInt();
-    std::vector<i64> nestedPtrs;
-    stream.seek(0x10);
-    for (int i = 0; i < nestedCount; i++) {
-        nestedPtrs.push_back(stream.readLong());
-    }
-    std::vector<PatchFsEntry> entries;
-    for (int i = 0; i < fileCount; i++) {
-        i64 namePtr = stream.readLong();
-        i64 contentPtr = stream.readLong();
-        i64 length = stream.readLong();
-        stream.readLong();
-        PatchFsEntry entry(namePtr, contentPtr, length);
-        entries.emplace_back(entry);
-    }
-    for (const PatchFsEntry& entry : entries) {
-        stream.seek(entry.nameOffset);
-        std::string name = stream.readString();
-        index.insert(std::make_pair(name, entry));
-    }
-    for (const i64 nestedPtr : nestedPtrs) {
-        stream.seek(nestedPtr);
-        std::string name = stream.readString();
-        fs::path nestedPath = path.parent_path() / name.c_str();
-        spdlog::info("Open nested PatchFS: '{}'", nestedPath.u8string());
-        nestedFs.emplace_back(nestedPath);
+#include "bufferpool.h"
+#include "cpk.h"
+#include "fine.h"
+#include "timeline.h"
+
+#include <mutex>
+#include <set>
+
+const i64 PATCHFS_TABLE_OFFSET = 0x10;
+const i64 PATCHFS_ENTRY_SIZE = 32;
+// Summary follows nested archive name after an extra zero byte, names are never empty so the byte can't start a name
+// and readers that stop at the name terminator never see the summary
+const i64 PATCHFS_SUMMARY_HEADER_SIZE = 17;
+const char PATCHFS_SUMMARY_MAGIC[] = "PFSS";
+const u32 PATCHFS_BLOOM_BITS_PER_NAME = 10;
+const u8 PATCHFS_BLOOM_HASH_COUNT = 7;
+// v2 entries point from the last table slot to a record: magic, u8 compression, 3 reserved bytes, i64 uncompressed
+// size and 128 bit XXH3 hash of stored payload. v1 entries have zero in that slot.
+const i64 PATCHFS_RECORD_SIZE = 32;
+const char PATCHFS_RECORD_MAGIC[] = "PFX2";
+
+// Names that are spread further apart than this are read one by one instead of in a single block
+static const i64 PATCHFS_MAX_NAME_BLOCK_SPAN = 16 * 1024 * 1024;
+static const i64 PATCHFS_NAME_READ_SIZE = 4096;
+// Largest unused gap between entries that are still merged into single read
+static const i64 PATCHFS_READAHEAD_MAX_GAP = 64 * 1024;
+// Chunk size used when copying and hashing payloads
+static const i64 PATCHFS_COPY_CHUNK_SIZE = 1024 * 1024;
+// Payloads smaller than this are never compressed
+static const i64 PATCHFS_MIN_COMPRESSED_LENGTH = 512;
+
+PatchFsArchive::PatchFsArchive(const fs::path& path, bool mapped) : file(path), uniqueNamesCount(0) {
+    if (!file.good()) return;
+    i64 fileLength = file.length();
+    if (fileLength < PATCHFS_TABLE_OFFSET) return;
+    u8 header[PATCHFS_TABLE_OFFSET];
+    file.readAt(0, header, PATCHFS_TABLE_OFFSET);
+    if (std::memcmp(header, "PATCHFS", 8) != 0) return;
+    Stream headerStream(header, PATCHFS_TABLE_OFFSET);
+    headerStream.seek(0x8);
+    i32 fileCount = headerStream.readInt();
+    i32 nestedCount = headerStream.readInt();
+    i64 tableSize = nestedCount * 8ll + fileCount * PATCHFS_ENTRY_SIZE;
+    if (fileCount < 0 || nestedCount < 0 || PATCHFS_TABLE_OFFSET + tableSize > fileLength) {
+        spdlog::error("PatchFS '{}' has invalid entry table", path.u8string());
+        return;
+    }
+    ByteBuffer table(tableSize);
+    file.readAt(PATCHFS_TABLE_OFFSET, table.data(), tableSize);
+
+    Stream tableStream(table);
+    std::vector<i64> nameOffsets;
+    for (i32 i = 0; i < nestedCount; i++) {
+        nameOffsets.push_back(tableStream.readLong());
+    }
+    readEntries(tableStream, fileCount);
+    checkedEntries = std::vector<std::atomic<bool>>(entries.size());
+    for (const auto& entry : entries) {
+        nameOffsets.push_back(entry.nameOffset);
+    }
+    std::vector<std::string_view> allNames;
+    readNames(nameOffsets, allNames);
+    names.assign(allNames.begin() + nestedCount, allNames.end());
+    uniqueNamesCount = std::set<std::string_view>(names.begin(), names.end()).size();
+    for (i32 i = 0; i < nestedCount; i++) {
+        std::optional<PatchFsSummary> summary = readSummary(nameOffsets[i] + allNames[i].size() + 1);
+        nested.emplace_back(path.parent_path() / std::string(allNames[i]), std::move(summary));
+    }
+    if (mapped) {
+        mapping = std::make_unique<MappedFile>(path);
+        // fall back to regular reads, mapping is only an optimization
+        if (!mapping->good() || mapping->length() != fileLength) {
+            spdlog::debug("Failed to map PatchFS '{}', using regular reads", path.u8string());
+            mapping.reset();
+        }
+    }
+}
+
+void PatchFsArchive::readEntries(Stream& entryTable, i32 fileCount) {
+    i64 fileLength = file.length();
+    i64 tableStart = entryTable.pos();
+    i64 recordsStart = fileLength;
+    i64 recordsEnd = 0;
+    for (i32 i = 0; i < fileCount; i++) {
+        entryTable.seek(tableStart + i * PATCHFS_ENTRY_SIZE + 24);
+        i64 recordOffset = entryTable.readLong();
+        if (recordOffset == 0) continue;
+        if (recordOffset < 0 || recordOffset + PATCHFS_RECORD_SIZE > fileLength) {
+            bail("PatchFS entry record is out of bounds");
+        }
+        recordsStart = std::min(recordsStart, recordOffset);
+        recordsEnd = std::max(recordsEnd, recordOffset + PATCHFS_RECORD_SIZE);
+    }
+    // records are written next to each other so they are read in one go, unless something else placed them apart
+    ByteBuffer records;
+    if (recordsEnd > recordsStart && recordsEnd - recordsStart <= PATCHFS_MAX_NAME_BLOCK_SPAN) {
+        records.resize(recordsEnd - recordsStart);
+        file.readAt(recordsStart, records.data(), records.size());
+    }
+    Stream recordsStream(records);
+    ByteBuffer record(PATCHFS_RECORD_SIZE);
+    Stream recordStream(record);
+    entryTable.seek(tableStart);
+    for (i32 i = 0; i < fileCount; i++) {
+        i64 nameOffset = entryTable.readLong();
+        i64 offset = entryTable.readLong();
+        i64 length = entryTable.readLong();
+        i64 recordOffset = entryTable.readLong();
+        if (recordOffset == 0) {
+            entries.emplace_back(nameOffset, offset, length);
+            continue;
+        }
+        Stream* recordInput = &recordsStream;
+        if (records.empty()) {
+            file.readAt(recordOffset, record.data(), PATCHFS_RECORD_SIZE);
+            recordInput = &recordStream;
+            recordInput->seek(0);
+        } else {
+            recordInput->seek(recordOffset - recordsStart);
+        }
+        if (recordInput->readString(4) != PATCHFS_RECORD_MAGIC) {
+            bail("Invalid PatchFS entry record");
+        }
+        u8 compression = recordInput->readByte();
+        if (compression > static_cast<u8>(PatchFsCompression::Layla)) {
+            spdlog::error("Unsupported PatchFS compression: {}", compression);
+            bail("Unsupported PatchFS compression");
+        }
+        recordInput->skip(3);
+        i64 size = recordInput->readLong();
+        XXH128_hash_t checksum;
+        checksum.low64 = recordInput->readLong();
+        checksum.high64 = recordInput->readLong();
+        entries.emplace_back(nameOffset, offset, length, static_cast<PatchFsCompression>(compression), size,
+                             checksum);
+    }
+}
+
+std::optional<PatchFsSummary> PatchFsArchive::readSummary(i64 offset) {
+    i64 fileLength = file.length();
+    if (offset + PATCHFS_SUMMARY_HEADER_SIZE > fileLength) return std::nullopt;
+    u8 header[PATCHFS_SUMMARY_HEADER_SIZE];
+    file.readAt(offset, header, PATCHFS_SUMMARY_HEADER_SIZE);
+    Stream headerStream(header, PATCHFS_SUMMARY_HEADER_SIZE);
+    // next name or padding of archives written without summaries
+    if (headerStream.readByte() != 0 || headerStream.readString(4) != PATCHFS_SUMMARY_MAGIC) return std::nullopt;
+    bool hasNested = (headerStream.readByte() & 1) != 0;
+    u8 hashCount = headerStream.readByte();
+    headerStream.skip(2);
+    i32 filesCount = headerStream.readInt();
+    u32 bloomSize = headerStream.readInt();
+    if (bloomSize == 0 || (bloomSize & (bloomSize - 1)) != 0 ||
+        offset + PATCHFS_SUMMARY_HEADER_SIZE + bloomSize > fileLength) {
+        spdlog::warn("Ignored invalid nested PatchFS summary at {}", offset);
+        return std::nullopt;
+    }
+    ByteBuffer bloom(bloomSize);
+    file.readAt(offset + PATCHFS_SUMMARY_HEADER_SIZE, bloom.data(), bloomSize);
+    return PatchFsSummary(filesCount, hasNested, hashCount, std::move(bloom));
+}
+
+void PatchFsArchive::readNames(const std::vector<i64>& offsets, std::vector<std::string_view>& output) {
+    if (offsets.empty()) return;
+    i64 fileLength = file.length();
+    auto bounds = std::minmax_element(offsets.begin(), offsets.end());
+    i64 blockStart = *bounds.first;
+    i64 lastStart = *bounds.second;
+    if (blockStart < 0 || lastStart >= fileLength) {
+        bail("PatchFS name offset is out of bounds");
+    }
+    std::vector<i64> blockOffsets;
+    if (lastStart - blockStart <= PATCHFS_MAX_NAME_BLOCK_SPAN) {
+        // one read covering all names, extended until the last name is terminated
+        i64 blockEnd = std::min(fileLength, lastStart + PATCHFS_NAME_READ_SIZE);
+        nameBlock.resize(blockEnd - blockStart);
+        file.readAt(blockStart, nameBlock.data(), nameBlock.size());
+        while (std::find(nameBlock.begin() + (lastStart - blockStart), nameBlock.end(), 0) == nameBlock.end()) {
+            if (blockEnd == fileLength) {
+                bail("PatchFS name is not terminated");
+            }
+            i64 readSize = std::min(fileLength - blockEnd, PATCHFS_NAME_READ_SIZE);
+            nameBlock.resize(nameBlock.size() + readSize);
+            file.readAt(blockEnd, nameBlock.data() + (blockEnd - blockStart), readSize);
+            blockEnd += readSize;
+        }
+        for (const i64 offset : offsets) {
+            blockOffsets.push_back(offset - blockStart);
+        }
+    } else {
+        // names are scattered across the file, gather them into the block one at a time
+        u8 chunk[256];
+        for (i64 offset : offsets) {
+            blockOffsets.push_back(nameBlock.size());
+            while (true) {
+                i64 readSize = std::min<i64>(sizeof(chunk), fileLength - offset);
+                if (readSize <= 0) {
+                    bail("PatchFS name is not terminated");
+                }
+                file.readAt(offset, chunk, readSize);
+                u8* end = std::find(chunk, chunk + readSize, 0);
+                nameBlock.insert(nameBlock.end(), chunk, end);
+                if (end != chunk + readSize) break;
+                offset += readSize;
+            }
+            nameBlock.push_back(0);
+        }
+    }
+    const char* block = reinterpret_cast<const char*>(nameBlock.data());
+    for (const i64 offset : blockOffsets) {
+        const u8* end = std::find(nameBlock.data() + offset, nameBlock.data() + nameBlock.size(), 0);
+        if (end == nameBlock.data() + nameBlock.size()) {
+            bail("PatchFS name is not terminated");
+        }
+        output.emplace_back(block + offset, end - (nameBlock.data() + offset));
+    }
+}
+
+const std::vector<PatchFsEntry>& PatchFsArchive::getEntries() const {
+    return entries;
+}
+
+std::string_view PatchFsArchive::getEntryName(u32 entry) const {
+    return names[entry];
+}
+
+std::vector<std::string_view> PatchFsArchive::getEntryNames() const {
+    return names;
+}
+
+i32 PatchFsArchive::getUniqueNamesCount() const {
+    return uniqueNamesCount;
+}
+
+const std::vector<PatchFsNestedRef>& PatchFsArchive::getNested() const {
+    return nested;
+}
+
+ByteBuffer PatchFsArchive::readContents(const PatchFsEntry& entry) const {
+    ByteBuffer data(entry.length);
+    readRange(entry.offset, data.data(), entry.length);
+    return decodeContents(entry, std::move(data));
+}
+
+ByteBuffer PatchFsArchive::decodeContents(const PatchFsEntry& entry, ByteBuffer stored) const {
+    checkPayload(entry, stored.data());
+    ByteBuffer contents;
+    switch (entry.compression) {
+    case PatchFsCompression::None:
+        return stored;
+    case PatchFsCompression::Vcdiff:
+        contents = applyPatch(nullptr, 0, stored.data(), stored.size());
+        break;
+    case PatchFsCompression::Layla:
+        contents = decompressLayla(stored);
+        break;
     }
+    if (static_cast<i64>(contents.size()) != entry.size) {
+        bail("PatchFS entry decompressed to unexpected size");
+    }
+    return contents;
+}
+
+void PatchFsArchive::readRange(i64 offset, u8* output, i64 length) const {
+    if (offset < 0 || length < 0 || offset + length > file.length()) {
+        bail("PatchFS entry is out of bounds");
+    }
+    if (mapping) {
+        std::memcpy(output, mapping->data() + offset, length);
+    } else {
+        file.readAt(offset, output, length);
+    }
+}
+
+const u8* PatchFsArchive::getMappedContents(const PatchFsEntry& entry) const {
+    const u8* contents = getMappedData(entry);
+    if (contents != nullptr) {
+        checkPayload(entry, contents);
+    }
+    return contents;
+}
+
+const u8* PatchFsArchive::getMappedData(const PatchFsEntry& entry) const {
+    if (!mapping) return nullptr;
+    if (entry.offset < 0 || entry.length < 0 || entry.offset + entry.length > mapping->length()) {
+        bail("PatchFS entry is out of bounds");
+    }
+    return mapping->data() + entry.offset;
+}
+
+void PatchFsArchive::checkPayload(const PatchFsEntry& entry, const u8* stored) const {
+    if (!entry.checksum) return;
+    usize index = &entry - entries.data();
+    if (checkedEntries[index].load(std::memory_order_relaxed)) return;
+    XXH128_hash_t hash = XXH3_128bits(stored, entry.length);
+    if (hash.low64 != entry.checksum->low64 || hash.high64 != entry.checksum->high64) {
+        spdlog::error("PatchFS entry '{}' is corrupted", names[index]);
+        bail("PatchFS is corrupted, please download it again");
+    }
+    checkedEntries[index].store(true, std::memory_order_relaxed);
+}
+
+bool PatchFsArchive::verify() const {
+    std::set<i64> verified;
+    ByteBuffer chunk;
+    for (u32 i = 0; i < entries.size(); i++) {
+        const PatchFsEntry& entry = entries[i];
+        if (!entry.checksum || checkedEntries[i] || !verified.insert(entry.offset).second) continue;
+        XXH128_hash_t hash;
+        const u8* mapped = getMappedData(entry);
+        if (mapped != nullptr) {
+            hash = XXH3_128bits(mapped, entry.length);
+        } else {
+            XXH3_state_t* state = XXH3_createState();
+            XXH3_128bits_reset(state);
+            chunk.resize(std::min(entry.length, PATCHFS_COPY_CHUNK_SIZE));
+            for (i64 pos = 0; pos < entry.length; pos += chunk.size()) {
+                i64 chunkSize = std::min<i64>(entry.length - pos, chunk.size());
+                readRange(entry.offset + pos, chunk.data(), chunkSize);
+                XXH3_128bits_update(state, chunk.data(), chunkSize);
+            }
+            hash = XXH3_128bits_digest(state);
+            XXH3_freeState(state);
+        }
+        if (hash.low64 != entry.checksum->low64 || hash.high64 != entry.checksum->high64) {
+            spdlog::error("PatchFS entry '{}' is corrupted", names[i]);
+            return false;
+        }
+        checkedEntries[i] = true;
+    }
+    return true;
+}
+
+PatchFsCompression compressPatchFsPayload(const u8* data, i64 length, ByteBuffer& output) {
+    output.clear();
+    if (length < PATCHFS_MIN_COMPRESSED_LENGTH || static_cast<u64>(length) > UINT32_MAX) {
+        return PatchFsCompression::None;
+    }
+    XdeltaSettings settings;
+    settings.secondary = XdeltaSecondary::Djw;
+    settings.level = 9;
+    ByteBuffer compressed = createPatch(nullptr, 0, data, length, settings);
+    // decoding has a cost, so small gains are not worth it
+    if (static_cast<i64>(compressed.size()) > length - length / 16) {
+        return PatchFsCompression::None;
+    }
+    output = std::move(compressed);
+    return PatchFsCompression::Vcdiff;
+}
+
+static u64 hashName(std::string_view name) {
+    return XXH3_64bits(name.data(), name.size());
+}
+
+PatchFsSummary::PatchFsSummary(i32 filesCount, bool hasNested, u8 hashCount, ByteBuffer bloom)
+    : filesCount(filesCount), hasNested(hasNested), hashCount(hashCount), bloom(std::move(bloom)) {
+}
+
+PatchFsSummary PatchFsSummary::create(const std::vector<std::string_view>& names, i32 filesCount, bool hasNested) {
+    usize bits = 64;
+    while (bits < names.size() * PATCHFS_BLOOM_BITS_PER_NAME) {
+        bits *= 2;
+    }
+    PatchFsSummary summary(filesCount, hasNested, PATCHFS_BLOOM_HASH_COUNT, ByteBuffer(bits / 8));
+    for (const auto& name : names) {
+        u64 hash = hashName(name);
+        u32 h1 = hash;
+        u32 h2 = (hash >> 32) | 1;
+        for (u32 i = 0; i < summary.hashCount; i++) {
+            u32 bit = (h1 + i * h2) & (bits - 1);
+            summary.bloom[bit / 8] |= 1 << (bit % 8);
+        }
+    }
+    return summary;
+}
+
+bool PatchFsSummary::mayContain(std::string_view name) const {
+    u32 bits = bloom.size() * 8;
+    u64 hash = hashName(name);
+    u32 h1 = hash;
+    u32 h2 = (hash >> 32) | 1;
+    for (u32 i = 0; i < hashCount; i++) {
+        u32 bit = (h1 + i * h2) & (bits - 1);
+        if ((bloom[bit / 8] & (1 << (bit % 8))) == 0) return false;
+    }
+    return true;
+}
+
+i32 PatchFsSummary::getFilesCount() const {
+    return filesCount;
+}
+
+bool PatchFsSummary::hasNestedArchives() const {
+    return hasNested;
+}
+
+void PatchFsSummary::write(Stream& stream) const {
+    stream.writeByte(0);
+    stream.writeString(PATCHFS_SUMMARY_MAGIC, 4);
+    stream.writeByte(hasNested ? 1 : 0);
+    stream.writeByte(hashCount);
+    stream.writeShort(0);
+    stream.writeInt(filesCount);
+    stream.writeInt(bloom.size());
+    stream.writeFully(bloom);
+}
+
+PatchFsIndex::Slot& PatchFsIndex::insert(const std::vector<PatchFsArchive*>& archives, u32 archive, u32 entry,
+                                         bool& inserted) {
+    // load factor is kept at or below 50%
+    if ((used + 1) * 2 > slots.size()) {
+        grow(archives);
+    }
+    std::string_view name = archives[archive]->getEntryName(entry);
+    u64 hash = hashName(name);
+    Slot& slot = slots[findSlot(archives, hash, name)];
+    inserted = slot.archive == EMPTY;
+    if (inserted) {
+        slot = Slot{hash, archive, entry};
+        used++;
+    }
+    return slot;
+}
+
+const PatchFsIndex::Slot* PatchFsIndex::find(const std::vector<PatchFsArchive*>& archives,
+                                             std::string_view name) const {
+    if (slots.empty()) return nullptr;
+    const Slot& slot = slots[findSlot(archives, hashName(name), name)];
+    return slot.archive == EMPTY ? nullptr : &slot;
+}
+
+void PatchFsIndex::grow(const std::vector<PatchFsArchive*>& archives) {
+    std::vector<Slot> oldSlots(std::max<usize>(16, slots.size() * 2), Slot{0, EMPTY, EMPTY});
+    oldSlots.swap(slots);
+    for (const Slot& slot : oldSlots) {
+        if (slot.archive == EMPTY) continue;
+        slots[findSlot(archives, slot.hash, archives[slot.archive]->getEntryName(slot.entry))] = slot;
+    }
+}
+
+usize PatchFsIndex::findSlot(const std::vector<PatchFsArchive*>& archives, u64 hash, std::string_view name) const {
+    usize mask = slots.size() - 1;
+    usize slot = hash & mask;
+    while (true) {
+        const Slot& current = slots[slot];
+        if (current.archive == EMPTY) return slot;
+        if (current.hash == hash && archives[current.archive]->getEntryName(current.entry) == name) return slot;
+        slot = (slot + 1) & mask;
+    }
+}
+
+PatchFsFile::PatchFsFile(const fs::path& path, bool mapped)
+    : mapped(mapped), unopenedCount(0), unsummarizedCount(0), filesCount(0) {
+    TIMELINE_SCOPE("PatchFsFile open");
+    archives.emplace_back(nullptr);
+    archivePtrs.push_back(nullptr);
+    archiveRefs.emplace_back(path, std::nullopt);
+    lookupOrder.push_back(0);
+    lookupRank.push_back(0);
+    unopenedCount++;
+    unsummarizedCount++;
+    openArchive(0);
+}
+
+void PatchFsFile::openArchive(u32 archive) {
+    if (archive != 0) {
+        spdlog::debug("Open nested PatchFS: '{}'", archiveRefs[archive].path.u8string());
+    }
+    archives[archive] = std::make_unique<PatchFsArchive>(archiveRefs[archive].path, mapped);
+    archivePtrs[archive] = archives[archive].get();
+    unopenedCount--;
+    // summary count covers the archive and its nested archives, those are counted again as they are added
+    if (archiveRefs[archive].summary) {
+        filesCount -= archiveRefs[archive].summary->getFilesCount();
+    } else {
+        unsummarizedCount--;
+    }
+    filesCount += archivePtrs[archive]->getUniqueNamesCount();
+    for (u32 entry = 0; entry < archivePtrs[archive]->getEntries().size(); entry++) {
+        bool inserted;
+        PatchFsIndex::Slot& slot = index.insert(archivePtrs, archive, entry, inserted);
+        // archive earlier in lookup order takes precedence for duplicate names
+        if (!inserted && lookupRank[archive] < lookupRank[slot.archive]) {
+            slot.archive = archive;
+            slot.entry = entry;
+        }
+    }
+    addNested(archive);
+}
+
+void PatchFsFile::addNested(u32 parent) {
+    std::vector<u32> children;
+    for (const auto& ref : archivePtrs[parent]->getNested()) {
+        children.push_back(archives.size());
+        archives.emplace_back(nullptr);
+        archivePtrs.push_back(nullptr);
+        archiveRefs.push_back(ref);
+        lookupRank.push_back(0);
+        unopenedCount++;
+        if (ref.summary) {
+            filesCount += ref.summary->getFilesCount();
+        } else {
+            unsummarizedCount++;
+        }
+    }
+    lookupOrder.insert(lookupOrder.begin() + lookupRank[parent] + 1, children.begin(), children.end());
+    for (u32 rank = 0; rank < lookupOrder.size(); rank++) {
+        lookupRank[lookupOrder[rank]] = rank;
+    }
+}
+
+bool PatchFsFile::mayContain(u32 archive, std::string_view name) const {
+    const auto& summary = archiveRefs[archive].summary;
+    // without summary or when archive has its own nested archives it has to be opened to find out
+    if (!summary || summary->hasNestedArchives()) return true;
+    return summary->mayContain(name);
+}
+
+bool PatchFsFile::verify() {
+    std::unique_lock lock(mutex);
+    for (u32 archive = 0; archive < archives.size(); archive++) {
+        if (archivePtrs[archive] == nullptr) {
+            openArchive(archive);
+        }
+        if (!archivePtrs[archive]->verify()) return false;
+    }
+    return true;
 }
 
 i32 PatchFsFile::getFilesCount() {
-    auto count = index.size();
-    for (auto& nested : nestedFs) {
-        count += nested.getFilesCount();
+    {
+        std::shared_lock lock(mutex);
+        if (unsummarizedCount == 0) return filesCount;
+    }
+    // archives without summary have to be opened to count their files
+    std::unique_lock lock(mutex);
+    for (u32 archive = 0; unsummarizedCount > 0 && archive < archives.size(); archive++) {
+        if (archivePtrs[archive] == nullptr && !archiveRefs[archive].summary) {
+            openArchive(archive);
+        }
     }
-    return count;
+    return filesCount;
 }
 
 i64 PatchFsFile::getFileLength(const std::string& name) {
-    auto entry = index.find(name);
-    if (entry != index.end()) return entry->second.length;
-    for (auto& nestedFile : nestedFs) {
-        auto nestedEntry = nestedFile.getFileLength(name);
-        if (nestedEntry != -1) return nestedEntry;
-    }
-    return -1;
+    EntryRef entryRef = getEntry(name);
+    if (entryRef.second == nullptr) return -1;
+    return entryRef.second->size;
 }
 
 ByteBuffer PatchFsFile::getFileContents(const std::string& name) {
+    EntryRef entryRef = getExistingEntry(name);
+    return entryRef.first->readContents(*entryRef.second);
+}
+
+PatchFsView PatchFsFile::getFileView(const std::string& name) {
+    EntryRef entryRef = getExistingEntry(name);
+    const u8* contents = nullptr;
+    if (entryRef.second->compression == PatchFsCompression::None) {
+        contents = entryRef.first->getMappedContents(*entryRef.second);
+    }
+    if (contents == nullptr) {
+        return PatchFsView(entryRef.first->readContents(*entryRef.second));
+    }
+    return PatchFsView(contents, entryRef.second->length);
+}
+
+std::vector<ByteBuffer> PatchFsFile::getFilesContents(const std::vector<std::string>& names, i64 readahead) {
+    std::vector<EntryRef> entryRefs;
+    std::vector<usize> order;
+    entryRefs.reserve(names.size());
+    for (usize i = 0; i < names.size(); i++) {
+        entryRefs.push_back(getExistingEntry(names[i]));
+        order.push_back(i);
+    }
+    std::sort(order.begin(), order.end(), [&entryRefs](usize a, usize b) {
+        const EntryRef& refA = entryRefs[a];
+        const EntryRef& refB = entryRefs[b];
+        if (refA.first != refB.first) return std::less<const PatchFsArchive*>()(refA.first, refB.first);
+        return refA.second->offset < refB.second->offset;
+    });
+
+    std::vector<ByteBuffer> contents(names.size());
+    PooledBuffer block;
+    u32 reads = 0;
+    usize first = 0;
+    while (first < order.size()) {
+        const PatchFsArchive* archive = entryRefs[order[first]].first;
+        const PatchFsEntry* firstEntry = entryRefs[order[first]].second;
+        i64 start = firstEntry->offset;
+        i64 end = start + firstEntry->length;
+        usize last = first + 1;
+        for (; last < order.size(); last++) {
+            const EntryRef& entryRef = entryRefs[order[last]];
+            if (entryRef.first != archive || entryRef.second->offset - end > PATCHFS_READAHEAD_MAX_GAP) break;
+            i64 mergedEnd = std::max(end, entryRef.second->offset + entryRef.second->length);
+            if (mergedEnd - start > readahead) break;
+            end = mergedEnd;
+        }
+        reads++;
+        if (last == first + 1) {
+            contents[order[first]] = archive->readContents(*firstEntry);
+        } else {
+            block.resize(end - start);
+            archive->readRange(start, block.data(), end - start);
+            for (usize i = first; i < last; i++) {
+                const PatchFsEntry* entry = entryRefs[order[i]].second;
+                const u8* begin = block.data() + (entry->offset - start);
+                contents[order[i]] = entryRefs[order[i]].first->decodeContents(
+                    *entry, ByteBuffer(begin, begin + entry->length));
+            }
+        }
+        first = last;
+    }
+    spdlog::trace("Read {} PatchFS entries using {} reads", names.size(), reads);
+    return contents;
+}
+
+u32 PatchFsFile::findEntry(std::string_view name, EntryRef& result) const {
+    const PatchFsIndex::Slot* slot = index.find(archivePtrs, name);
+    // archives that come before the hit in lookup order and may contain the name have to be opened first
+    u32 hitRank = slot == nullptr ? lookupOrder.size() : lookupRank[slot->archive];
+    for (u32 rank = 0; unopenedCount > 0 && rank < hitRank; rank++) {
+        u32 archive = lookupOrder[rank];
+        if (archivePtrs[archive] == nullptr && mayContain(archive, name)) {
+            return archive;
+        }
+    }
+    if (slot == nullptr) {
+        result = EntryRef(nullptr, nullptr);
+    } else {
+        const PatchFsArchive* archive = archivePtrs[slot->archive];
+        result = EntryRef(archive, &archive->getEntries()[slot->entry]);
+    }
+    return PatchFsIndex::EMPTY;
+}
+
+PatchFsFile::EntryRef PatchFsFile::getEntry(const std::string& name) {
+    TIMELINE_SCOPE("PatchFsFile lookup");
+    EntryRef result;
+    {
+        std::shared_lock lock(mutex);
+        if (findEntry(name, result) == PatchFsIndex::EMPTY) return result;
+    }
+    // archives and entries are never moved once opened so returned pointers stay valid after the lock is released
+    std::unique_lock lock(mutex);
+    while (true) {
+        u32 candidate = findEntry(name, result);
+        if (candidate == PatchFsIndex::EMPTY) return result;
+        openArchive(candidate);
+    }
+}
+
+PatchFsFile::EntryRef PatchFsFile::getExistingEntry(const std::string& name) {
     spdlog::trace("Get PatchFS entry for: '{}'", name);
-    auto entryPair = getEntry(name);
-    if (entryPair.first == nullptr || entryPair.second == nullptr) {
+    EntryRef entryRef = getEntry(name);
+    if (entryRef.first == nullptr || entryRef.second == nullptr) {
         spdlog::critical("Missing PatchFS entry for: '{}'", name);
         bail("Missing PatchFS entry");
     }
-    return entryPair.first->readContents(entryPair.second);
+    return entryRef;
 }
 
-std::pair<PatchFsFile*, PatchFsEntry*> PatchFsFile::getEntry(const std::string& name) {
-    auto entry = index.find(name);
-    if (entry != index.end()) return std::make_pair(this, &(entry->second));
-    for (auto& nestedFile : nestedFs) {
-        auto nestedEntry = nestedFile.getEntry(name);
-        if (nestedEntry.first != nullptr && nestedEntry.second != nullptr) {
-            return nestedEntry;
-        }
+PatchFsView::PatchFsView(ByteBuffer buffer) : storage(std::move(buffer)), ptr(nullptr), length(0), owned(true) {
+}
+
+PatchFsView::PatchFsView(const u8* data, usize size) : ptr(data), length(size), owned(false) {
+}
+
+const u8* PatchFsView::data() const {
+    return owned ? storage.data() : ptr;
+}
+
+usize PatchFsView::size() const {
+    return owned ? storage.size() : length;
+}
+
+PatchFsWriter::PatchFsWriter(const fs::path& path, u32 maxEntries, const std::vector<std::string>& nested,
+                             u32 alignment)
+    : path(path), maxEntries(maxEntries), nested(nested), alignment(std::max(1u, alignment)), dedupedSize(0),
+      finished(false) {
+    createEmptyFile(path);
+    stream = std::make_unique<Stream>(path);
+    if (!stream->good()) {
+        bail("Failed to open PatchFS for writing");
+    }
+    spdlog::debug("Write PatchFS: '{}', reserved {} entries", path.u8string(), maxEntries);
+    endOffset = PATCHFS_TABLE_OFFSET + nested.size() * 8 + maxEntries * PATCHFS_ENTRY_SIZE;
+    payloadOffset = endOffset;
+}
+
+PatchFsWriter::~PatchFsWriter() {
+    if (!finished) {
+        spdlog::warn("PatchFS writer was not finished, output is incomplete");
+    }
+}
+
+void PatchFsWriter::add(const std::string& name, const ByteBuffer& data) {
+    add(name, data.data(), data.size());
+}
+
+void PatchFsWriter::add(const std::string& name, const u8* data, i64 length) {
+    beginPayload();
+    XXH128_hash_t hash = XXH3_128bits(data, length);
+    if (payloadOffsets.find(std::make_tuple(hash.low64, hash.high64, length)) == payloadOffsets.end()) {
+        stream->writeFully(data, length);
+    }
+    endPayload(name, length, hash);
+}
+
+void PatchFsWriter::addCompressed(const std::string& name, PatchFsCompression compression, const ByteBuffer& data,
+                                  i64 size) {
+    beginPayload();
+    XXH128_hash_t hash = XXH3_128bits(data.data(), data.size());
+    if (payloadOffsets.find(std::make_tuple(hash.low64, hash.high64, data.size())) == payloadOffsets.end()) {
+        stream->writeFully(data.data(), data.size());
     }
-    return std::make_pair(nullptr, nullptr);
+    endPayload(name, data.size(), hash, compression, size);
 }
 
-ByteBuffer PatchFsFile::readContents(PatchFsEntry* entry) {
-    ByteBuffer data(entry->length);
-    stream.seek(entry->offset);
-    stream.readFully(data.data(), entry->length);
-    return data;
+void PatchFsWriter::add(const std::string& name, Stream& source, i64 length) {
+    beginPayload();
+    // payload is written while it's hashed, if it turns out to be a duplicate the space is reused by next payload
+    XXH3_state_t* state = XXH3_createState();
+    XXH3_128bits_reset(state);
+    ByteBuffer chunk(std::min(length, PATCHFS_COPY_CHUNK_SIZE));
+    i64 remaining = length;
+    while (remaining > 0) {
+        i64 chunkSize = std::min<i64>(remaining, chunk.size());
+        source.readFully(chunk.data(), chunkSize);
+        XXH3_128bits_update(state, chunk.data(), chunkSize);
+        stream->writeFully(chunk.data(), chunkSize);
+        remaining -= chunkSize;
+    }
+    XXH128_hash_t hash = XXH3_128bits_digest(state);
+    XXH3_freeState(state);
+    if (!source.good()) {
+        bail("Failed to read PatchFS entry source");
+    }
+    endPayload(name, length, hash);
+}
+
+void PatchFsWriter::beginPayload() {
+    if (entries.size() >= maxEntries) {
+        bail("Too many PatchFS entries");
+    }
+    // payloads are aligned to allow direct access to mapped data
+    payloadOffset = (endOffset + alignment - 1) / alignment * alignment;
+    stream->seek(endOffset);
+    stream->writeZeros(payloadOffset - endOffset);
+}
+
+void PatchFsWriter::endPayload(const std::string& name, i64 length, XXH128_hash_t hash, PatchFsCompression compression,
+                               i64 size) {
+    if (size < 0) {
+        size = length;
+    }
+    auto key = std::make_tuple(hash.low64, hash.high64, length);
+    auto existing = payloadOffsets.find(key);
+    if (existing != payloadOffsets.end()) {
+        spdlog::trace("Add PatchFS entry '{}', size: {}, same content as entry at {}", name, length, existing->second);
+        entries.push_back(WrittenEntry{name, existing->second, length, compression, size, hash});
+        dedupedSize += length;
+        return;
+    }
+    spdlog::trace("Add PatchFS entry '{}', size: {}, offset: {}", name, length, payloadOffset);
+    payloadOffsets.emplace(key, payloadOffset);
+    entries.push_back(WrittenEntry{name, payloadOffset, length, compression, size, hash});
+    endOffset = payloadOffset + length;
+}
+
+void PatchFsWriter::writeRecord(const WrittenEntry& entry) {
+    stream->writeString(PATCHFS_RECORD_MAGIC);
+    stream->writeByte(static_cast<u8>(entry.compression));
+    stream->writeZeros(3);
+    stream->writeLong(entry.size);
+    stream->writeLong(entry.hash.low64);
+    stream->writeLong(entry.hash.high64);
+}
+
+void PatchFsWriter::writeNestedSummary(const fs::path& nestedPath) {
+    if (!fs::exists(nestedPath)) {
+        spdlog::warn("Nested PatchFS '{}' not found, it will be opened eagerly by readers", nestedPath.u8string());
+        return;
+    }
+    PatchFsArchive nestedArchive(nestedPath);
+    bool hasNested = !nestedArchive.getNested().empty();
+    i32 filesCount = hasNested ? PatchFsFile(nestedPath).getFilesCount() : nestedArchive.getUniqueNamesCount();
+    PatchFsSummary::create(nestedArchive.getEntryNames(), filesCount, hasNested).write(*stream);
+}
+
+void PatchFsWriter::finish() {
+    std::sort(entries.begin(), entries.end(), [](const auto& a, const auto& b) { return a.name < b.name; });
+    i64 fileLength = stream->length();
+    stream->seek(endOffset);
+    std::vector<i64> nestedOffsets;
+    for (const auto& name : nested) {
+        i64 nameOffset = stream->pos();
+        stream->writeString(name);
+        stream->writeByte(0);
+        writeNestedSummary(path.parent_path() / name);
+        nestedOffsets.push_back(nameOffset);
+    }
+    std::vector<i64> nameOffsets;
+    for (const auto& entry : entries) {
+        nameOffsets.push_back(stream->pos());
+        stream->writeString(entry.name);
+        stream->writeByte(0);
+    }
+    i64 recordsStart = (stream->pos() + 7) / 8 * 8;
+    stream->writeZeros(recordsStart - stream->pos());
+    for (const auto& entry : entries) {
+        writeRecord(entry);
+    }
+    i64 dataEnd = stream->pos();
+    stream->seek(0);
+    stream->writeString("PATCHFS");
+    stream->writeByte(0);
+    stream->writeInt(entries.size());
+    stream->writeInt(nested.size());
+    for (const i64 nestedOffset : nestedOffsets) {
+        stream->writeLong(nestedOffset);
+    }
+    for (usize i = 0; i < entries.size(); i++) {
+        const WrittenEntry& entry = entries[i];
+        stream->writeLong(nameOffsets[i]);
+        stream->writeLong(entry.offset);
+        stream->writeLong(entry.length);
+        stream->writeLong(recordsStart + i * PATCHFS_RECORD_SIZE);
+    }
+    if (!stream->good()) {
+        bail("Failed to write PatchFS");
+    }
+    stream.reset();
+    if (fileLength > dataEnd) {
+        // last payload was a duplicate written from a stream, drop its data
+        fs::resize_file(path, dataEnd);
+    }
+    finished = true;
+    spdlog::debug("PatchFS written, {} entries, {} bytes deduplicated", entries.size(), dedupedSize);
 }
@@ -2,30 +2,229 @@
 
 #include "platform.h"
 
+#include <atomic>
+#include <optional>
+#include <shared_mutex>
+#include <string_view>
+#include <tuple>
+
+#include "xxhash.h"
+
+#include "fileio.h"
 #include "stream.h"
 
-class PatchFsEntry;
+// Method used to compress stored PatchFS payload
+enum class PatchFsCompression : u8 {
+    None = 0,
+    // VCDIFF without source, decoded with xdelta
+    Vcdiff = 1,
+    Layla = 2,
+};
+
+class PatchFsEntry {
+  public:
+    PatchFsEntry(i64 nameOffset, i64 offset, i64 length, PatchFsCompression compression = PatchFsCompression::None,
+                 i64 size = -1, std::optional<XXH128_hash_t> checksum = std::nullopt)
+        : nameOffset(nameOffset), offset(offset), length(length), compression(compression),
+          size(size < 0 ? length : size), checksum(checksum) {
+    }
+    const i64 nameOffset;
+    const i64 offset;
+    // length of stored payload
+    const i64 length;
+    const PatchFsCompression compression;
+    // length of contents after decompression
+    const i64 size;
+    // hash of stored payload, only present in v2 entries
+    const std::optional<XXH128_hash_t> checksum;
+};
+
+// Compresses PatchFS payload, returns None and leaves output empty when compression would not save enough space
+PatchFsCompression compressPatchFsPayload(const u8* data, i64 length, ByteBuffer& output);
+
+// Summary of nested archive stored in parent archive after the nested archive name and an extra zero byte. Allows
+// deciding whether a name can be in nested archive without opening it.
+class PatchFsSummary {
+  public:
+    PatchFsSummary(i32 filesCount, bool hasNested, u8 hashCount, ByteBuffer bloom);
+    static PatchFsSummary create(const std::vector<std::string_view>& names, i32 filesCount, bool hasNested);
+    bool mayContain(std::string_view name) const;
+    i32 getFilesCount() const;
+    bool hasNestedArchives() const;
+    void write(Stream& stream) const;
+
+  private:
+    i32 filesCount;
+    bool hasNested;
+    u8 hashCount;
+    ByteBuffer bloom;
+};
+
+class PatchFsNestedRef {
+  public:
+    PatchFsNestedRef(const fs::path& path, std::optional<PatchFsSummary> summary) : path(path), summary(summary) {
+    }
+    fs::path path;
+    std::optional<PatchFsSummary> summary;
+};
+
+// Single PatchFS file on disk, nested archives it references are opened by PatchFsFile. In mapped mode contents are
+// read from memory mapping of the file and can be accessed directly.
+class PatchFsArchive {
+  public:
+    PatchFsArchive(const fs::path& path, bool mapped = false);
+    const std::vector<PatchFsEntry>& getEntries() const;
+    std::string_view getEntryName(u32 entry) const;
+    std::vector<std::string_view> getEntryNames() const;
+    i32 getUniqueNamesCount() const;
+    const std::vector<PatchFsNestedRef>& getNested() const;
+    // Payload checksum is checked the first time an entry is read or decoded
+    ByteBuffer readContents(const PatchFsEntry& entry) const;
+    ByteBuffer decodeContents(const PatchFsEntry& entry, ByteBuffer stored) const;
+    void readRange(i64 offset, u8* output, i64 length) const;
+    // Returns pointer into mapped archive or null when archive is not mapped
+    const u8* getMappedContents(const PatchFsEntry& entry) const;
+    // Checks stored payloads against their checksums, entries without checksum are skipped
+    bool verify() const;
+
+  private:
+    void readEntries(Stream& entryTable, i32 fileCount);
+    void readNames(const std::vector<i64>& offsets, std::vector<std::string_view>& output);
+    std::optional<PatchFsSummary> readSummary(i64 offset);
+    const u8* getMappedData(const PatchFsEntry& entry) const;
+    void checkPayload(const PatchFsEntry& entry, const u8* stored) const;
+    ReadOnlyFile file;
+    std::unique_ptr<MappedFile> mapping;
+    std::vector<PatchFsEntry> entries;
+    // set once checksum of the entry matched, entries are shared by concurrent readers
+    mutable std::vector<std::atomic<bool>> checkedEntries;
+    // all names are loaded in a single block, views point into it
+    ByteBuffer nameBlock;
+    std::vector<std::string_view> names;
+    i32 uniqueNamesCount;
+    std::vector<PatchFsNestedRef> nested;
+};
+
+// Open addressing hash table mapping entry names to archive and entry numbers. Archives that are not opened yet are
+// represented by null pointers.
+class PatchFsIndex {
+  public:
+    static constexpr u32 EMPTY = UINT32_MAX;
+    struct Slot {
+        u64 hash;
+        u32 archive;
+        u32 entry;
+    };
+    // returns existing slot if name is already present, inserted is set to false in that case
+    Slot& insert(const std::vector<PatchFsArchive*>& archives, u32 archive, u32 entry, bool& inserted);
+    const Slot* find(const std::vector<PatchFsArchive*>& archives, std::string_view name) const;
+
+  private:
+    void grow(const std::vector<PatchFsArchive*>& archives);
+    usize findSlot(const std::vector<PatchFsArchive*>& archives, u64 hash, std::string_view name) const;
+    std::vector<Slot> slots;
+    usize used = 0;
+};
+
+// Default byte budget of single merged read done by PatchFsFile::getFilesContents
+const i64 PATCHFS_READAHEAD_SIZE = 4 * 1024 * 1024;
+
+// Contents of PatchFS entry, either owning its buffer or referencing memory that outlives the view
+class PatchFsView {
+  public:
+    PatchFsView(ByteBuffer buffer);
+    PatchFsView(const u8* data, usize size);
+    const u8* data() const;
+    usize size() const;
+
+  private:
+    ByteBuffer storage;
+    const u8* ptr;
+    usize length;
+    bool owned;
+};
 
+// Nested archives are opened on first lookup that misses already opened archives and only when their summary allows
+// that they contain the name. All public functions can be called from multiple threads, lookups share the lock and
+// only opening of nested archive takes it exclusively. In mapped mode views point directly into mapped archives and
+// stay valid for the lifetime of PatchFsFile.
 class PatchFsFile {
   public:
-    PatchFsFile(const fs::path& path);
+    PatchFsFile(const fs::path& path, bool mapped = false);
     i32 getFilesCount();
     i64 getFileLength(const std::string& name);
     ByteBuffer getFileContents(const std::string& name);
+    PatchFsView getFileView(const std::string& name);
+    // Opens all nested archives and verifies checksums of all entries, entries are otherwise checked on first read
+    bool verify();
+    // Contents are returned in the order of names, reads are done in archive order and nearby entries are merged
+    // into reads of up to readahead bytes
+    std::vector<ByteBuffer> getFilesContents(const std::vector<std::string>& names,
+                                             i64 readahead = PATCHFS_READAHEAD_SIZE);
 
   private:
-    Stream stream;
-    std::pair<PatchFsFile*, PatchFsEntry*> getEntry(const std::string& name);
-    ByteBuffer readContents(PatchFsEntry* entry);
-    std::map<std::string, PatchFsEntry> index;
-    std::vector<PatchFsFile> nestedFs;
+    using EntryRef = std::pair<const PatchFsArchive*, const PatchFsEntry*>;
+    void addNested(u32 parent);
+    void openArchive(u32 archive);
+    bool mayContain(u32 archive, std::string_view name) const;
+    u32 findEntry(std::string_view name, EntryRef& result) const;
+    EntryRef getEntry(const std::string& name);
+    EntryRef getExistingEntry(const std::string& name);
+    std::shared_mutex mutex;
+    bool mapped;
+    // indexed by archive number, null until archive is opened
+    std::vector<std::unique_ptr<PatchFsArchive>> archives;
+    std::vector<PatchFsArchive*> archivePtrs;
+    std::vector<PatchFsNestedRef> archiveRefs;
+    // archive numbers in lookup order, root followed by nested archives depth first
+    std::vector<u32> lookupOrder;
+    std::vector<u32> lookupRank;
+    u32 unopenedCount;
+    // unopened archives without summary, their files are counted only after they are opened
+    u32 unsummarizedCount;
+    // files of opened archives and summarized files of archives that are not opened yet
+    i32 filesCount;
+    PatchFsIndex index;
 };
 
-class PatchFsEntry {
+// Writes PatchFS archives. Entry table size has to be known before payloads are written, unused table slots are left
+// empty. Payloads are streamed to disk as they are added, names and entry records are stored after payloads.
+// Identical payloads are detected by hash and stored only once.
+class PatchFsWriter {
   public:
-    PatchFsEntry(i64 nameOffset, i64 offset, i64 length) : nameOffset(nameOffset), offset(offset), length(length) {
-    }
-    const i64 nameOffset;
-    const i64 offset;
-    const i64 length;
+    PatchFsWriter(const fs::path& path, u32 maxEntries, const std::vector<std::string>& nested = {},
+                  u32 alignment = 16);
+    ~PatchFsWriter();
+    void add(const std::string& name, const ByteBuffer& data);
+    void add(const std::string& name, const u8* data, i64 length);
+    void add(const std::string& name, Stream& source, i64 length);
+    // Adds payload already compressed by compressPatchFsPayload, size is length of uncompressed contents
+    void addCompressed(const std::string& name, PatchFsCompression compression, const ByteBuffer& data, i64 size);
+    void finish();
+
+  private:
+    struct WrittenEntry {
+        std::string name;
+        i64 offset;
+        i64 length;
+        PatchFsCompression compression;
+        i64 size;
+        XXH128_hash_t hash;
+    };
+    void beginPayload();
+    void writeNestedSummary(const fs::path& nestedPath);
+    void writeRecord(const WrittenEntry& entry);
+    void endPayload(const std::string& name, i64 length, XXH128_hash_t hash,
+                    PatchFsCompression compression = PatchFsCompression::None, i64 size = -1);
+    const fs::path path;
+    std::unique_ptr<Stream> stream;
+    const u32 maxEntries;
+    const std::vector<std::string> nested;
+    const u32 alignment;
+    i64 payloadOffset;
+    i64 endOffset;
+    i64 dedupedSize;
+    bool finished;
+    std::vector<WrittenEntry> entries;
+    std::map<std::tuple<u64, u64, i64>, i64> payloadOffsets;
 };
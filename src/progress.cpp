@@ -2,36 +2,123 @@
 
 #include "spdlog/spdlog.h"
 
-Progress::Progress(std::vector<float> w) : previousPartsProgress(0), currentPartProgress(0), finished(false), weights(w) {
-    std::reverse(weights.begin(), weights.end());
-    currentWeight = weights.back();
-    weights.pop_back();
-    spdlog::trace("Set inital progress weight to: {}", currentWeight);
+Progress::Progress(std::vector<float> weights, std::chrono::milliseconds reportInterval)
+    : reportInterval(reportInterval), parts(std::make_unique<Part[]>(weights.size())), partCount(weights.size()),
+      currentPart(0), startTime(std::chrono::steady_clock::now()), lastReportTime(startTime), lastReportBytes(0),
+      lastReportFiles(0), lastReportPercent(-1), stopping(false) {
+    for (u32 i = 0; i < partCount; i++) {
+        parts[i].weight = weights[i];
+    }
+    spdlog::trace("Set inital progress weight to: {}", partCount > 0 ? weights[0] : 0.0f);
+    reporter = std::thread(&Progress::reporterLoop, this);
 }
 
-void Progress::updatePart(u32 current, u32 max) {
-    if (finished) return;
-    u32 partProgress = (current * 100.0 / max);
-    u32 weightedPartProgress = partProgress * currentWeight;
-    if (weightedPartProgress > currentPartProgress) {
-        currentPartProgress = weightedPartProgress;
-        spdlog::trace("Part progress: {}%", partProgress);
-        spdlog::info("Total progress: {}%", previousPartsProgress + currentPartProgress);
+Progress::~Progress() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
     }
+    stopCondition.notify_all();
+    reporter.join();
+    report(true);
+}
+
+u32 Progress::getShardIndex() {
+    static std::atomic<u32> nextIndex(0);
+    thread_local u32 index = nextIndex++ % SHARD_COUNT;
+    return index;
+}
+
+void Progress::updatePart(u32 current, u32 max) {
+    u32 part = currentPart.load(std::memory_order_relaxed);
+    if (part >= partCount) return;
+    parts[part].totalFiles.store(max, std::memory_order_relaxed);
+    parts[part].position.store(std::min(current, max), std::memory_order_relaxed);
     if (current >= max) {
-        nextPart();
+        currentPart.store(part + 1, std::memory_order_relaxed);
+        if (part + 1 < partCount) {
+            spdlog::trace("Proceded to next progress part, set progress weight to: {}", parts[part + 1].weight);
+        }
+    }
+}
+
+void Progress::setPartTotal(u32 part, u64 totalBytes, u64 totalFiles) {
+    if (part >= partCount) return;
+    parts[part].totalBytes.store(totalBytes, std::memory_order_relaxed);
+    parts[part].totalFiles.store(totalFiles, std::memory_order_relaxed);
+}
+
+void Progress::addBytes(u32 part, u64 bytes) {
+    parts[part].shards[getShardIndex()].bytes.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+void Progress::addFiles(u32 part, u64 files) {
+    parts[part].shards[getShardIndex()].files.fetch_add(files, std::memory_order_relaxed);
+}
+
+float Progress::getFraction() const {
+    float fraction = 0;
+    for (u32 i = 0; i < partCount; i++) {
+        const Part& part = parts[i];
+        u64 bytes = 0;
+        u64 files = part.position.load(std::memory_order_relaxed);
+        for (const auto& shard : part.shards) {
+            bytes += shard.bytes.load(std::memory_order_relaxed);
+            files += shard.files.load(std::memory_order_relaxed);
+        }
+        u64 totalBytes = part.totalBytes.load(std::memory_order_relaxed);
+        u64 totalFiles = part.totalFiles.load(std::memory_order_relaxed);
+        float partFraction = 0;
+        if (totalBytes > 0) {
+            partFraction = std::min(1.0, static_cast<double>(bytes) / totalBytes);
+        } else if (totalFiles > 0) {
+            partFraction = std::min(1.0, static_cast<double>(files) / totalFiles);
+        }
+        fraction += part.weight * partFraction;
+    }
+    return fraction;
+}
+
+void Progress::sumCounters(u64& bytes, u64& files) const {
+    bytes = 0;
+    files = 0;
+    for (u32 i = 0; i < partCount; i++) {
+        files += parts[i].position.load(std::memory_order_relaxed);
+        for (const auto& shard : parts[i].shards) {
+            bytes += shard.bytes.load(std::memory_order_relaxed);
+            files += shard.files.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+void Progress::reporterLoop() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (!stopCondition.wait_for(lock, reportInterval, [this] { return stopping; })) {
+        report(false);
     }
 }
 
-void Progress::nextPart() {
-    if (finished) return;
-    previousPartsProgress += 100 * currentWeight;
-    if (weights.size() == 0) {
-        finished = true;
-    } else {
-        currentPartProgress = 0;
-        currentWeight = weights.back();
-        weights.pop_back();
-        spdlog::trace("Proceded to next progress part, set progress weight to: {}", currentWeight);
+void Progress::report(bool final) {
+    float fraction = getFraction();
+    i32 percent = fraction * 100;
+    if (percent == lastReportPercent) return;
+    auto now = std::chrono::steady_clock::now();
+    double sinceLast = std::chrono::duration<double>(now - lastReportTime).count();
+    double elapsed = std::chrono::duration<double>(now - startTime).count();
+    u64 bytes;
+    u64 files;
+    sumCounters(bytes, files);
+    double bytesPerSecond = sinceLast > 0 ? (bytes - lastReportBytes) / sinceLast : 0;
+    double filesPerSecond = sinceLast > 0 ? (files - lastReportFiles) / sinceLast : 0;
+    lastReportTime = now;
+    lastReportBytes = bytes;
+    lastReportFiles = files;
+    lastReportPercent = percent;
+    if (final || fraction <= 0 || fraction >= 1) {
+        spdlog::info("Total progress: {}%", percent);
+        return;
     }
+    u64 eta = elapsed * (1 - fraction) / fraction;
+    spdlog::info("Total progress: {}%, {:.1f} MB/s, {:.1f} files/s, ETA {}:{:02}", percent,
+                 bytesPerSecond / (1024 * 1024), filesPerSecond, eta / 60, eta % 60);
 }
@@ -2,16 +2,59 @@
 
 #include "platform.h"
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+// Aggregates progress of weighted parts. Parts can be advanced one after another with updatePart or run at the same
+// time with counters updated from any thread. Progress is logged by background thread at most once per report
+// interval, only when total percentage changes.
 class Progress {
   public:
-    Progress(std::vector<float> weights);
+    Progress(std::vector<float> weights, std::chrono::milliseconds reportInterval = std::chrono::milliseconds(1000));
+    ~Progress();
+    Progress(const Progress&) = delete;
+    Progress& operator=(const Progress&) = delete;
+    // Sequential parts, reaching max moves to the next part
     void updatePart(u32 current, u32 max);
+    // Concurrent parts, progress of part is measured in bytes when it has byte total and in files otherwise
+    void setPartTotal(u32 part, u64 totalBytes, u64 totalFiles);
+    void addBytes(u32 part, u64 bytes);
+    void addFiles(u32 part, u64 files = 1);
+    float getFraction() const;
 
   private:
-    void nextPart();
-    u32 previousPartsProgress;
-    u32 currentPartProgress;
-    float currentWeight;
-    bool finished;
-    std::vector<float> weights;
+    static const u32 SHARD_COUNT = 16;
+    // each shard on its own cache line so workers don't contend
+    struct alignas(64) Shard {
+        std::atomic<u64> bytes{0};
+        std::atomic<u64> files{0};
+    };
+    struct Part {
+        float weight;
+        std::atomic<u64> totalBytes{0};
+        std::atomic<u64> totalFiles{0};
+        // set by updatePart, counted together with shards
+        std::atomic<u64> position{0};
+        Shard shards[SHARD_COUNT];
+    };
+    static u32 getShardIndex();
+    void sumCounters(u64& bytes, u64& files) const;
+    void reporterLoop();
+    void report(bool final);
+    const std::chrono::milliseconds reportInterval;
+    std::unique_ptr<Part[]> parts;
+    const u32 partCount;
+    std::atomic<u32> currentPart;
+    const std::chrono::steady_clock::time_point startTime;
+    std::chrono::steady_clock::time_point lastReportTime;
+    u64 lastReportBytes;
+    u64 lastReportFiles;
+    i32 lastReportPercent;
+    std::mutex mutex;
+    std::condition_variable stopCondition;
+    bool stopping;
+    std::thread reporter;
 };
@@ -0,0 +1,92 @@
+#include "sparse.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#ifdef _WIN32
+#include <winioctl.h>
+#elif defined(__linux__)
+#include <fcntl.h>
+#include <linux/falloc.h>
+#include <unistd.h>
+#endif
+
+bool isZeroFilled(const u8* data, usize len) {
+    usize i = 0;
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 64 <= len; i += 64) {
+        __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+        __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i + 16));
+        __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i + 32));
+        __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i + 48));
+        __m128i acc = _mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, zero)) != 0xFFFF) return false;
+    }
+#endif
+    // 8 bytes at a time, compiler vectorizes this on targets without SSE2
+    for (; i + 8 <= len; i += 8) {
+        u64 word;
+        std::memcpy(&word, data + i, 8);
+        if (word != 0) return false;
+    }
+    for (; i < len; i++) {
+        if (data[i] != 0) return false;
+    }
+    return true;
+}
+
+#ifdef _WIN32
+HolePuncher::HolePuncher(const fs::path& path) {
+    handle = CreateFileW(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+                         OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    DWORD returned;
+    supported = handle != INVALID_HANDLE_VALUE &&
+                DeviceIoControl(handle, FSCTL_SET_SPARSE, NULL, 0, NULL, 0, &returned, NULL);
+}
+
+HolePuncher::~HolePuncher() {
+    if (handle != INVALID_HANDLE_VALUE) {
+        CloseHandle(handle);
+    }
+}
+
+bool HolePuncher::punch(i64 offset, i64 length) {
+    if (!supported) return false;
+    FILE_ZERO_DATA_INFORMATION zeroData;
+    zeroData.FileOffset.QuadPart = offset;
+    zeroData.BeyondFinalZero.QuadPart = offset + length;
+    DWORD returned;
+    supported = DeviceIoControl(handle, FSCTL_SET_ZERO_DATA, &zeroData, sizeof(zeroData), NULL, 0, &returned, NULL);
+    return supported;
+}
+#elif defined(__linux__)
+HolePuncher::HolePuncher(const fs::path& path) {
+    fd = open(path.c_str(), O_WRONLY | O_CLOEXEC);
+    supported = fd >= 0;
+}
+
+HolePuncher::~HolePuncher() {
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+bool HolePuncher::punch(i64 offset, i64 length) {
+    if (!supported) return false;
+    supported = fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, length) == 0;
+    return supported;
+}
+#else
+HolePuncher::HolePuncher(__attribute__((unused)) const fs::path& path) : fd(-1), supported(false) {
+    // not supported on this platform, caller writes zeros instead
+}
+
+HolePuncher::~HolePuncher() {
+}
+
+bool HolePuncher::punch(__attribute__((unused)) i64 offset, __attribute__((unused)) i64 length) {
+    return false;
+}
+#endif
@@ -0,0 +1,28 @@
+#pragma once
+
+#include "platform.h"
+
+// Granularity used when looking for zero filled blocks, matches common file system block size
+const i64 SPARSE_BLOCK_SIZE = 4096;
+
+bool isZeroFilled(const u8* data, usize len);
+
+// Deallocates ranges of file so they read back as zeros. File is opened once and kept open for repeated use, after
+// the first failure the file system is assumed to not support it and further calls fail without trying.
+class HolePuncher {
+  public:
+    HolePuncher(const fs::path& path);
+    ~HolePuncher();
+    HolePuncher(const HolePuncher&) = delete;
+    HolePuncher& operator=(const HolePuncher&) = delete;
+    // Range should cover whole blocks, returns false when caller has to write zeros instead
+    bool punch(i64 offset, i64 length);
+
+  private:
+#ifdef _WIN32
+    HANDLE handle;
+#else
+    int fd;
+#endif
+    bool supported;
+};
@@ -1,6 +1,7 @@
 #include "stream.h"
 
-Stream::Stream(const fs::path& path, bool readOnly) : stream(std::make_unique<FileStreamIO>(path, readOnly)) {
+Stream::Stream(const fs::path& path, bool readOnly, bool sparse)
+    : stream(std::make_unique<FileStreamIO>(path, readOnly, sparse)) {
 }
 
 Stream::Stream(ByteBuffer& buf) : stream(std::make_unique<BufferStreamIO>(buf.data(), buf.size())) {
@@ -87,9 +88,9 @@ std::string Stream::readString() {
 }
 
 std::string Stream::readString(i32 len) {
-    ByteBuffer buf(len);
-    readFully(buf);
-    return std::string(buf.begin(), buf.end());
+    std::string string(len, '\0');
+    readFully(reinterpret_cast<u8*>(string.data()), len);
+    return string;
 }
 
 void Stream::readFully(ByteBuffer& buf) {
@@ -174,11 +175,18 @@ void Stream::writeFully(const u8* buf, i64 bufLen) {
     stream->writeFully(buf, bufLen);
 }
 
+void Stream::writeZeros(i64 len) {
+    stream->writeZeros(len);
+}
+
 void Stream::align(i64 alignment) {
     if (pos() % alignment == 0) return;
     i64 targetCount = (pos() / alignment + 1) * alignment;
-    ByteBuffer blank(targetCount - pos());
-    writeFully(blank);
+    writeZeros(targetCount - pos());
+}
+
+void Stream::flush() {
+    stream->flush();
 }
 
 bool Stream::good() {
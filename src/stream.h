@@ -5,7 +5,7 @@
 
 class Stream {
   public:
-    Stream(const fs::path& path, bool readOnly = false);
+    Stream(const fs::path& path, bool readOnly = false, bool sparse = false);
     Stream(ByteBuffer& buf);
     Stream(u8* data, i64 size);
 
@@ -40,8 +40,10 @@ class Stream {
     void writeString(const std::string& string, i32 len);
     void writeFully(const ByteBuffer& buf);
     void writeFully(const u8* buf, i64 bufLen);
+    void writeZeros(i64 len);
 
     void align(i64 alignment);
+    void flush();
 
     bool good();
     i64 pos();
@@ -1,5 +1,22 @@
 #include "streamio.h"
 
+#include "spdlog/spdlog.h"
+
+#include "sparse.h"
+
+static const u8 ZERO_BLOCK[SPARSE_BLOCK_SIZE] = {};
+
+void StreamIO::writeZeros(i64 len) {
+    while (len > 0) {
+        i64 chunk = std::min(len, SPARSE_BLOCK_SIZE);
+        writeFully(ZERO_BLOCK, chunk);
+        len -= chunk;
+    }
+}
+
+void StreamIO::flush() {
+}
+
 static std::ios_base::openmode fstreamOpenFlags(bool readOnly) {
     if (readOnly) {
         return std::ios::binary | std::ios::in;
@@ -8,15 +25,38 @@ static std::ios_base::openmode fstreamOpenFlags(bool readOnly) {
     }
 }
 
-FileStreamIO::FileStreamIO(const fs::path& path, bool readOnly) : stream(std::fstream(path, fstreamOpenFlags(readOnly))) {
+FileStreamIO::FileStreamIO(const fs::path& path, bool readOnly, bool sparse)
+    : path(path), sparse(sparse && !readOnly), sparseLength(0), stream(std::fstream(path, fstreamOpenFlags(readOnly))),
+      stats(IoStats::get(path.u8string())) {
     seek(0);
 }
 
+FileStreamIO::~FileStreamIO() {
+    stats->add(counters);
+    if (!sparse) return;
+    stream.close();
+    // zero blocks at the end of file were skipped, extend it to the logical length
+    std::error_code ec;
+    if (sparseLength > static_cast<i64>(fs::file_size(path, ec)) && !ec) {
+        fs::resize_file(path, sparseLength, ec);
+    }
+    if (ec) {
+        spdlog::error("Failed to extend sparse file '{}' to {} bytes: {}", path.u8string(), sparseLength, ec.message());
+    }
+}
+
 bool FileStreamIO::good() {
     return stream.good();
 }
 
+void FileStreamIO::flush() {
+    IoTimer timer(counters);
+    stream.flush();
+}
+
 void FileStreamIO::seek(i64 pos) {
+    counters.countSeek();
+    IoTimer timer(counters);
     stream.seekg(pos, std::ios::beg);
 }
 
@@ -25,6 +65,10 @@ i64 FileStreamIO::pos() {
 }
 
 i64 FileStreamIO::length() {
+    return std::max(physicalLength(), sparseLength);
+}
+
+i64 FileStreamIO::physicalLength() {
     i64 prevPos = pos();
     stream.seekg(0, std::ios::end);
     i64 length = pos();
@@ -33,23 +77,105 @@ i64 FileStreamIO::length() {
 }
 
 void FileStreamIO::write(u8 byte) {
+    counters.countWrite(1);
     stream.write(reinterpret_cast<char*>(&byte), 1);
 }
 
 u8 FileStreamIO::read() {
+    counters.countRead(1);
     i8 byte;
     stream.read(reinterpret_cast<char*>(&byte), 1);
     return byte;
 }
 
 void FileStreamIO::writeFully(const u8* buf, i64 bufLen) {
-    stream.write(reinterpret_cast<const char*>(buf), bufLen);
+    counters.countWrite(bufLen);
+    IoTimer timer(counters);
+    if (!sparse) {
+        stream.write(reinterpret_cast<const char*>(buf), bufLen);
+        return;
+    }
+    // split input at file system block boundaries, runs of zero blocks are skipped instead of written
+    i64 start = pos();
+    i64 runStart = 0;
+    bool runZero = false;
+    i64 offset = 0;
+    while (offset < bufLen) {
+        i64 chunk = std::min(bufLen - offset, SPARSE_BLOCK_SIZE - (start + offset) % SPARSE_BLOCK_SIZE);
+        bool zero = chunk == SPARSE_BLOCK_SIZE && isZeroFilled(buf + offset, chunk);
+        if (zero != runZero && offset > runStart) {
+            if (runZero) {
+                skipZeros(offset - runStart);
+            } else {
+                stream.write(reinterpret_cast<const char*>(buf + runStart), offset - runStart);
+            }
+            runStart = offset;
+        }
+        runZero = zero;
+        offset += chunk;
+    }
+    if (runZero) {
+        skipZeros(bufLen - runStart);
+    } else {
+        stream.write(reinterpret_cast<const char*>(buf + runStart), bufLen - runStart);
+    }
 }
 
 void FileStreamIO::readFully(u8* buf, i64 bufLen) {
+    counters.countRead(bufLen);
+    IoTimer timer(counters);
     stream.read(reinterpret_cast<char*>(buf), bufLen);
 }
 
+void FileStreamIO::writeZeros(i64 len) {
+    if (sparse) {
+        skipZeros(len);
+    } else {
+        StreamIO::writeZeros(len);
+    }
+}
+
+void FileStreamIO::skipZeros(i64 len) {
+    i64 start = pos();
+    i64 end = start + len;
+    i64 physical = physicalLength();
+    if (start < physical) {
+        // part of range that already exists in the file must read back as zeros, only whole blocks are deallocated
+        // and the rest is overwritten
+        i64 existingEnd = std::min(end, physical);
+        i64 holeStart = (start + SPARSE_BLOCK_SIZE - 1) / SPARSE_BLOCK_SIZE * SPARSE_BLOCK_SIZE;
+        i64 holeEnd = existingEnd / SPARSE_BLOCK_SIZE * SPARSE_BLOCK_SIZE;
+        IoTimer timer(counters);
+        bool punched = false;
+        if (holeStart < holeEnd) {
+            if (!holes) {
+                holes = std::make_unique<HolePuncher>(path);
+            }
+            // buffered writes to the range would allocate it again
+            stream.flush();
+            punched = holes->punch(holeStart, holeEnd - holeStart);
+        }
+        if (punched) {
+            overwriteZeros(start, holeStart);
+            overwriteZeros(holeEnd, existingEnd);
+        } else {
+            overwriteZeros(start, existingEnd);
+        }
+    }
+    seek(end);
+    sparseLength = std::max(sparseLength, end);
+}
+
+void FileStreamIO::overwriteZeros(i64 start, i64 end) {
+    if (start >= end) return;
+    seek(start);
+    for (i64 remaining = end - start; remaining > 0;) {
+        i64 chunk = std::min(remaining, SPARSE_BLOCK_SIZE);
+        stream.write(reinterpret_cast<const char*>(ZERO_BLOCK), chunk);
+        remaining -= chunk;
+    }
+}
+
 BufferStreamIO::BufferStreamIO(u8* data, i64 len) : data(data), dataLen(len), position(0) {
 }
 
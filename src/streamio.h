@@ -2,6 +2,10 @@
 
 #include "platform.h"
 
+#include "iostats.h"
+
+class HolePuncher;
+
 class StreamIO {
   public:
     virtual ~StreamIO() {
@@ -14,13 +18,15 @@ class StreamIO {
     virtual u8 read() = 0;
     virtual void writeFully(const u8* buf, i64 len) = 0;
     virtual void readFully(u8* buf, i64 len) = 0;
+    virtual void writeZeros(i64 len);
+    // Passes buffered writes to the operating system
+    virtual void flush();
 };
 
 class FileStreamIO : public StreamIO {
   public:
-    FileStreamIO(const fs::path& path, bool readOnly = false);
-    virtual ~FileStreamIO() {
-    }
+    FileStreamIO(const fs::path& path, bool readOnly = false, bool sparse = false);
+    virtual ~FileStreamIO();
     virtual bool good();
     virtual void seek(i64 pos);
     virtual i64 pos();
@@ -29,9 +35,21 @@ class FileStreamIO : public StreamIO {
     virtual u8 read();
     virtual void writeFully(const u8* buf, i64 len);
     virtual void readFully(u8* buf, i64 len);
+    virtual void writeZeros(i64 len);
+    virtual void flush();
 
   private:
+    i64 physicalLength();
+    void skipZeros(i64 len);
+    void overwriteZeros(i64 start, i64 end);
+    const fs::path path;
+    const bool sparse;
+    i64 sparseLength;
     std::fstream stream;
+    // opened on first skipped range that already exists in the file
+    std::unique_ptr<HolePuncher> holes;
+    IoCounters counters;
+    IoStats* const stats;
 };
 
 class BufferStreamIO : public StreamIO {
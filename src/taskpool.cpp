@@ -0,0 +1,74 @@
+#include "taskpool.h"
+
+#include "spdlog/spdlog.h"
+
+TaskPool::TaskPool(u32 threads, usize maxQueued) : maxQueued(maxQueued), running(0), stopping(false) {
+    if (threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    spdlog::trace("Start task pool with {} threads", threads);
+    for (u32 i = 0; i < threads; i++) {
+        workers.emplace_back(&TaskPool::workerLoop, this);
+    }
+}
+
+TaskPool::~TaskPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    taskAvailable.notify_all();
+    for (auto& worker : workers) {
+        worker.join();
+    }
+}
+
+void TaskPool::submit(std::function<void()> task) {
+    std::unique_lock<std::mutex> lock(mutex);
+    if (maxQueued != 0) {
+        taskDone.wait(lock, [this] { return queue.size() < maxQueued; });
+    }
+    queue.push_back(std::move(task));
+    lock.unlock();
+    taskAvailable.notify_one();
+}
+
+void TaskPool::wait() {
+    std::unique_lock<std::mutex> lock(mutex);
+    taskDone.wait(lock, [this] { return queue.empty() && running == 0; });
+    if (failure) {
+        std::exception_ptr rethrown = failure;
+        failure = nullptr;
+        std::rethrow_exception(rethrown);
+    }
+}
+
+u32 TaskPool::getThreadCount() const {
+    return workers.size();
+}
+
+void TaskPool::workerLoop() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        taskAvailable.wait(lock, [this] { return stopping || !queue.empty(); });
+        if (queue.empty()) return;
+        std::function<void()> task = std::move(queue.front());
+        queue.pop_front();
+        bool skip = failure != nullptr;
+        running++;
+        lock.unlock();
+        taskDone.notify_all();
+        if (!skip) {
+            // first failure is reported from wait, tasks queued after it are dropped
+            try {
+                task();
+            } catch (...) {
+                std::lock_guard<std::mutex> failureLock(mutex);
+                if (!failure) failure = std::current_exception();
+            }
+        }
+        lock.lock();
+        running--;
+        taskDone.notify_all();
+    }
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include "platform.h"
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <thread>
+
+class TaskPool {
+  public:
+    // threads set to 0 uses hardware concurrency, maxQueued set to 0 doesn't limit queued tasks
+    TaskPool(u32 threads = 0, usize maxQueued = 0);
+    ~TaskPool();
+    void submit(std::function<void()> task);
+    void wait();
+    u32 getThreadCount() const;
+
+  private:
+    void workerLoop();
+    const usize maxQueued;
+    std::vector<std::thread> workers;
+    std::deque<std::function<void()>> queue;
+    std::mutex mutex;
+    std::condition_variable taskAvailable;
+    std::condition_variable taskDone;
+    usize running;
+    bool stopping;
+    std::exception_ptr failure;
+};
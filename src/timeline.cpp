@@ -0,0 +1,93 @@
+#include "timeline.h"
+
+#include <mutex>
+
+#include "picojson.h"
+#include "spdlog/spdlog.h"
+
+class TimelineEvent {
+  public:
+    const char* name;
+    i64 start;
+    i64 end;
+};
+
+// Owned by registry so events of threads that already exited are still written
+class TimelineBuffer {
+  public:
+    u32 threadId;
+    std::mutex mutex;
+    std::vector<TimelineEvent> events;
+};
+
+class TimelineRegistry {
+  public:
+    std::mutex mutex;
+    fs::path output;
+    std::vector<std::shared_ptr<TimelineBuffer>> buffers;
+};
+
+static TimelineRegistry& getRegistry() {
+    static TimelineRegistry registry;
+    return registry;
+}
+
+static TimelineBuffer& getThreadBuffer() {
+    thread_local std::shared_ptr<TimelineBuffer> buffer;
+    if (!buffer) {
+        buffer = std::make_shared<TimelineBuffer>();
+        TimelineRegistry& registry = getRegistry();
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        buffer->threadId = registry.buffers.size() + 1;
+        registry.buffers.push_back(buffer);
+    }
+    return *buffer;
+}
+
+void Timeline::enable(const fs::path& output) {
+    TimelineRegistry& registry = getRegistry();
+    {
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        registry.output = output;
+    }
+    spdlog::info("Timeline will be written to '{}'", output.u8string());
+    enabled = true;
+}
+
+void Timeline::record(const char* name, i64 start, i64 end) {
+    TimelineBuffer& buffer = getThreadBuffer();
+    // only contended while timeline is being written
+    std::lock_guard<std::mutex> lock(buffer.mutex);
+    buffer.events.push_back(TimelineEvent{name, start, end});
+}
+
+void Timeline::finish() {
+    if (!isEnabled()) return;
+    enabled = false;
+    TimelineRegistry& registry = getRegistry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    picojson::array events;
+    for (const auto& buffer : registry.buffers) {
+        std::lock_guard<std::mutex> bufferLock(buffer->mutex);
+        for (const auto& event : buffer->events) {
+            picojson::object json;
+            json["name"] = picojson::value(event.name);
+            json["ph"] = picojson::value("X");
+            json["ts"] = picojson::value(event.start);
+            json["dur"] = picojson::value(event.end - event.start);
+            json["pid"] = picojson::value(static_cast<i64>(1));
+            json["tid"] = picojson::value(static_cast<i64>(buffer->threadId));
+            events.emplace_back(json);
+        }
+    }
+    picojson::object root;
+    root["traceEvents"] = picojson::value(events);
+    root["displayTimeUnit"] = picojson::value("ms");
+    std::ofstream file(registry.output, std::ios::binary | std::ios::trunc);
+    file << picojson::value(root).serialize();
+    if (!file.good()) {
+        spdlog::error("Failed to write timeline to '{}'", registry.output.u8string());
+        return;
+    }
+    spdlog::info("Timeline with {} spans written", events.size());
+}
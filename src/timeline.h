@@ -0,0 +1,48 @@
+#pragma once
+
+#include "platform.h"
+
+#include <atomic>
+#include <chrono>
+
+// Records scoped spans into per thread buffers and writes them as Chrome trace JSON, which can be opened in
+// chrome://tracing or Perfetto. When disabled, a scope costs a single relaxed atomic load.
+class Timeline {
+  public:
+    static void enable(const fs::path& output);
+    static bool isEnabled() {
+        return enabled.load(std::memory_order_relaxed);
+    }
+    static i64 now() {
+        return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch())
+            .count();
+    }
+    static void record(const char* name, i64 start, i64 end);
+    // Writes recorded spans when enabled
+    static void finish();
+
+  private:
+    inline static std::atomic<bool> enabled{false};
+};
+
+class TimelineScope {
+  public:
+    TimelineScope(const char* name) : name(name), start(Timeline::isEnabled() ? Timeline::now() : -1) {
+    }
+    ~TimelineScope() {
+        if (start >= 0) {
+            Timeline::record(name, start, Timeline::now());
+        }
+    }
+    TimelineScope(const TimelineScope&) = delete;
+    TimelineScope& operator=(const TimelineScope&) = delete;
+
+  private:
+    const char* const name;
+    const i64 start;
+};
+
+#define TIMELINE_CONCAT_INNER(a, b) a##b
+#define TIMELINE_CONCAT(a, b) TIMELINE_CONCAT_INNER(a, b)
+// Name has to be a string literal or otherwise outlive the timeline
+#define TIMELINE_SCOPE(name) TimelineScope TIMELINE_CONCAT(timelineScope, __LINE__)(name)
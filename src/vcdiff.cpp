@@ -0,0 +1,92 @@
+#include "vcdiff.h"
+
+#include "spdlog/spdlog.h"
+
+// Walks VCDIFF (RFC 3284) headers without decoding instructions, see section 4 of the RFC for the layout
+class VcdiffCursor {
+  public:
+    VcdiffCursor(const u8* data, usize len) : data(data), len(len), pos(0) {
+    }
+
+    bool eof() const {
+        return pos >= len;
+    }
+
+    u8 readByte() {
+        if (pos >= len) {
+            bail("Unexpected end of VCDIFF data");
+        }
+        return data[pos++];
+    }
+
+    u64 readVarint() {
+        u64 value = 0;
+        for (int i = 0; i < 10; i++) {
+            u8 byte = readByte();
+            value = (value << 7) | (byte & 0x7F);
+            if ((byte & 0x80) == 0) return value;
+        }
+        bail("Invalid VCDIFF integer");
+        __builtin_unreachable();
+    }
+
+    void skip(u64 num) {
+        if (num > len - pos) {
+            bail("Unexpected end of VCDIFF data");
+        }
+        pos += num;
+    }
+
+    usize position() const {
+        return pos;
+    }
+
+  private:
+    const u8* data;
+    const usize len;
+    usize pos;
+};
+
+std::vector<VcdiffWindow> readVcdiffWindows(const u8* patch, usize patchLen) {
+    VcdiffCursor input(patch, patchLen);
+    if (input.readByte() != 0xD6 || input.readByte() != 0xC3 || input.readByte() != 0xC4) {
+        bail("Invalid VCDIFF magic value");
+    }
+    input.readByte(); // version
+    u8 headerIndicator = input.readByte();
+    if (headerIndicator & VCD_DECOMPRESS) {
+        input.readByte(); // secondary compressor id
+    }
+    if (headerIndicator & VCD_CODETABLE) {
+        input.skip(input.readVarint());
+    }
+    if (headerIndicator & VCD_APPHEADER) {
+        input.skip(input.readVarint());
+    }
+
+    std::vector<VcdiffWindow> windows;
+    while (!input.eof()) {
+        u8 windowIndicator = input.readByte();
+        u64 segmentLength = 0;
+        u64 segmentPosition = 0;
+        if (windowIndicator & (VCD_SOURCE | VCD_TARGET)) {
+            segmentLength = input.readVarint();
+            segmentPosition = input.readVarint();
+        }
+        u64 deltaLength = input.readVarint();
+        usize deltaStart = input.position();
+        u64 targetLength = input.readVarint();
+        windows.emplace_back(windowIndicator, segmentLength, segmentPosition, targetLength);
+        input.skip(deltaLength - (input.position() - deltaStart));
+    }
+    spdlog::trace("VCDIFF contains {} windows", windows.size());
+    return windows;
+}
+
+u64 getVcdiffTargetSize(const u8* patch, usize patchLen) {
+    u64 size = 0;
+    for (const auto& window : readVcdiffWindows(patch, patchLen)) {
+        size += window.targetLength;
+    }
+    return size;
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include "platform.h"
+
+// Header indicator bits
+const u8 VCD_DECOMPRESS = 0x01;
+const u8 VCD_CODETABLE = 0x02;
+const u8 VCD_APPHEADER = 0x04;
+
+// Window indicator bits
+const u8 VCD_SOURCE = 0x01;
+const u8 VCD_TARGET = 0x02;
+const u8 VCD_ADLER32 = 0x04;
+
+class VcdiffWindow {
+  public:
+    VcdiffWindow(u8 indicator, u64 segmentLength, u64 segmentPosition, u64 targetLength)
+        : indicator(indicator), segmentLength(segmentLength), segmentPosition(segmentPosition),
+          targetLength(targetLength) {
+    }
+    bool copiesFromSource() const {
+        return (indicator & VCD_SOURCE) != 0;
+    }
+    const u8 indicator;
+    const u64 segmentLength;
+    const u64 segmentPosition;
+    const u64 targetLength;
+};
+
+std::vector<VcdiffWindow> readVcdiffWindows(const u8* patch, usize patchLen);
+u64 getVcdiffTargetSize(const u8* patch, usize patchLen);
@@ -0,0 +1,127 @@
+#include "platform.h"
+
+#include <atomic>
+#include <random>
+#include <thread>
+
+#include "spdlog/spdlog.h"
+
+#include "patchfs.h"
+
+// Many readers look up entries of freshly opened PatchFS at once, so nested archives are opened lazily while other
+// threads hold the shared lock. Every returned byte is compared with the expected contents.
+
+static const u32 STRESS_THREADS = 16;
+static const u32 STRESS_ROUNDS = 8;
+static const u32 STRESS_LOOKUPS = 2000;
+static const u32 STRESS_ENTRIES = 256;
+
+// Odd entries are repetitive so that they are stored compressed
+static ByteBuffer entryContents(const std::string& name) {
+    std::mt19937 rng(std::hash<std::string>()(name));
+    ByteBuffer data(64 + rng() % 8192);
+    bool compressible = (data.size() & 1) != 0;
+    for (usize i = 0; i < data.size(); i++) {
+        data[i] = compressible ? static_cast<u8>(i / 64) : static_cast<u8>(rng());
+    }
+    return data;
+}
+
+static void writeArchive(const fs::path& path, const std::vector<std::string>& names,
+                         const std::vector<std::string>& nested) {
+    PatchFsWriter writer(path, names.size(), nested);
+    for (const auto& name : names) {
+        ByteBuffer data = entryContents(name);
+        ByteBuffer compressed;
+        PatchFsCompression compression = compressPatchFsPayload(data.data(), data.size(), compressed);
+        if (compression == PatchFsCompression::None) {
+            writer.add(name, data);
+        } else {
+            writer.addCompressed(name, compression, compressed, data.size());
+        }
+    }
+    writer.finish();
+}
+
+// Root contains nested archives a and b, a contains its own nested archive c
+static std::vector<std::string> createArchives(const fs::path& dir) {
+    std::map<std::string, std::vector<std::string>> names;
+    std::vector<std::string> all;
+    for (const std::string archive : {"root", "a", "b", "c"}) {
+        for (u32 i = 0; i < STRESS_ENTRIES; i++) {
+            names[archive].push_back(archive + "/file" + std::to_string(i) + ".bin");
+            all.push_back(names[archive].back());
+        }
+    }
+    writeArchive(dir / "c.pfs", names["c"], {});
+    writeArchive(dir / "b.pfs", names["b"], {});
+    writeArchive(dir / "a.pfs", names["a"], {"c.pfs"});
+    writeArchive(dir / "root.pfs", names["root"], {"a.pfs", "b.pfs"});
+    return all;
+}
+
+static bool isExpected(const std::string& name, const u8* data, usize length) {
+    ByteBuffer expected = entryContents(name);
+    return expected.size() == length && std::memcmp(expected.data(), data, length) == 0;
+}
+
+// Reads name using randomly picked function, batch reads also include other random names
+static bool checkLookup(PatchFsFile& patchFs, const std::vector<std::string>& names, const std::string& name,
+                        std::mt19937& rng) {
+    try {
+        switch (rng() % 3) {
+        case 0: {
+            ByteBuffer contents = patchFs.getFileContents(name);
+            return isExpected(name, contents.data(), contents.size());
+        }
+        case 1: {
+            PatchFsView view = patchFs.getFileView(name);
+            return isExpected(name, view.data(), view.size());
+        }
+        default: {
+            std::vector<std::string> batch{name, names[rng() % names.size()], names[rng() % names.size()]};
+            auto contents = patchFs.getFilesContents(batch);
+            for (usize i = 0; i < batch.size(); i++) {
+                if (!isExpected(batch[i], contents[i].data(), contents[i].size())) return false;
+            }
+            return true;
+        }
+        }
+    } catch (const std::runtime_error&) {
+        return false;
+    }
+}
+
+int main() {
+    spdlog::set_level(spdlog::level::err);
+    fs::path dir = fs::temp_directory_path() / "fine-patchfs-stress";
+    fs::remove_all(dir);
+    fs::create_directories(dir);
+    std::vector<std::string> names = createArchives(dir);
+    std::atomic<u32> failures(0);
+    for (u32 round = 0; round < STRESS_ROUNDS; round++) {
+        PatchFsFile patchFs(dir / "root.pfs", round % 2 == 1);
+        std::vector<std::thread> threads;
+        for (u32 thread = 0; thread < STRESS_THREADS; thread++) {
+            threads.emplace_back([&, thread]() {
+                std::mt19937 rng(round * STRESS_THREADS + thread);
+                for (u32 i = 0; i < STRESS_LOOKUPS; i++) {
+                    const std::string& name = names[rng() % names.size()];
+                    if (!checkLookup(patchFs, names, name, rng)) {
+                        spdlog::error("Round {}: unexpected contents of '{}'", round, name);
+                        failures++;
+                    }
+                }
+            });
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+    }
+    fs::remove_all(dir);
+    if (failures > 0) {
+        spdlog::error("PatchFS stress test failed, {} lookups returned unexpected contents", failures.load());
+        return 1;
+    }
+    return 0;
+}
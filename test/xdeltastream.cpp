@@ -0,0 +1,74 @@
+#include "platform.h"
+
+#include <random>
+
+#include "spdlog/spdlog.h"
+
+#include "fine.h"
+#include "stream.h"
+
+// Streaming decode must fail when the patch ends before the last window is complete instead of returning a
+// truncated target.
+
+static const usize TEST_SIZE = 4 << 20;
+
+static ByteBuffer randomBuffer(u32 seed, usize size) {
+    std::mt19937 rng(seed);
+    ByteBuffer data(size);
+    for (auto& value : data) {
+        value = static_cast<u8>(rng());
+    }
+    return data;
+}
+
+// Returns false when decoding failed
+static bool decode(ByteBuffer& source, ByteBuffer& patch, usize patchLen, ByteBuffer& output) {
+    Stream sourceStream(source);
+    Stream patchStream(patch.data(), patchLen);
+    Stream outputStream(output);
+    try {
+        applyPatch(sourceStream, outputStream, patchStream);
+    } catch (const std::runtime_error&) {
+        return false;
+    }
+    return true;
+}
+
+int main() {
+    spdlog::set_level(spdlog::level::err);
+    ByteBuffer source = randomBuffer(1, TEST_SIZE);
+    ByteBuffer target = source;
+    // changes spread over the whole target so that every window has its own instructions
+    ByteBuffer changes = randomBuffer(2, TEST_SIZE / 4096);
+    for (usize i = 0; i < changes.size(); i++) {
+        target[i * 4096 + changes[i] % 4096] ^= 0xff;
+    }
+    ByteBuffer patch = createPatch(source.data(), source.size(), target.data(), target.size());
+
+    u32 failures = 0;
+    ByteBuffer output(target.size());
+    if (!decode(source, patch, patch.size(), output) || output != target) {
+        spdlog::error("Complete patch was not decoded to expected target");
+        failures++;
+    }
+    // decoding errors of truncated patches are expected
+    spdlog::set_level(spdlog::level::off);
+    std::vector<usize> truncatedLengths{patch.size() - 1, patch.size() / 2, patch.size() / 7};
+    std::vector<usize> accepted;
+    for (usize patchLen : truncatedLengths) {
+        ByteBuffer truncatedOutput(target.size());
+        if (decode(source, patch, patchLen, truncatedOutput)) {
+            accepted.push_back(patchLen);
+        }
+    }
+    spdlog::set_level(spdlog::level::err);
+    for (usize patchLen : accepted) {
+        spdlog::error("Patch truncated to {} of {} bytes was accepted", patchLen, patch.size());
+        failures++;
+    }
+    if (failures > 0) {
+        spdlog::error("Xdelta stream test failed, {} checks failed", failures);
+        return 1;
+    }
+    return 0;
+}